@@ -14,30 +14,53 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 
 #include <arpa/telnet.h>
 
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <histedit.h>
 #include <libgen.h>
 #include <limits.h>
+#include <poll.h>
 #include <pwd.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "ftp.h"
+#include "xmalloc.h"
 
-#define ARGVMAX	64
+#define ARGVMAX		64
+#define MAX_PARALLEL	16
+
+#define MIRROR_UP	0x01	/* local tree to remote */
+#define MIRROR_DELETE	0x02	/* remove what the source lacks */
+
+/* directories still to do and the tally of a mirror, see mirror_tree */
+struct mirror_state {
+	char	**queue;
+	size_t	  nqueue, qhead, qsize;
+	int	  nfailed, nremoved, nskipped, nxfered;
+	int	  verbose;
+};
 
 static void	 cmd_interrupt(int);
 static int	 cmd_lookup(const char *);
+static struct iobuf *ctrl_login(int);
+static void	 data_accept(const char *);
 static FILE	*data_fopen(const char *);
+static void	 data_prefetch(void);
 static void	 do_open(int, char **);
 static void	 do_help(int, char **);
 static void	 do_quit(int, char **);
@@ -49,11 +72,61 @@ static void	 do_passive(int, char **);
 static void	 do_lcd(int, char **);
 static void	 do_lpwd(int, char **);
 static void	 do_put(int, char **);
+static void	 do_reput(int, char **);
 static void	 do_mget(int, char **);
+static void	 do_mirror(int, char **);
+static void	 do_rmirror(int, char **);
+static void	 do_modez(int, char **);
+static void	 do_parallel(int, char **);
+static int	 entry_cmp(const void *, const void *);
 static void	 ftp_abort(void);
+static int	 xfer_mode(void);
+static int	 xfer_reply(void);
+static int	 get_file(const char *, const char *, off_t *);
+static int	 list_dir(const char *, struct ftp_entry **);
+static void	 mirror_dir(const char *, const char *, const char *, int);
+static int	 mirror_event(struct mirror_state *, char *);
+static int	 mirror_file(const char *, const char *, const char *,
+		    struct ftp_entry *, int);
+static void	 mirror_local(struct mirror_state *, const char *,
+		    const char *, int);
+static void	 mirror_report(int, const char *, ...)
+		    __attribute__((__format__ (printf, 2, 3)));
+static void	 mirror_tree(const char *, const char *, int);
+static void	 mirror_worker(int, const char *, const char *, int);
+static void	 mxfer(int (*)(const char *, const char *, off_t *), int,
+		    char **, int);
+static void	 mxfer_worker(int (*)(const char *, const char *, off_t *),
+		    char **, int, const char *, off_t *, int *);
+static char	*path_join(const char *, const char *);
 static char	*prompt(void);
+static int	 put_file(const char *, const char *, off_t *);
+static int	 put_file_at(const char *, const char *, off_t, off_t *);
+static char	*remote_abspath(const char *);
+static int	 remote_cmd(const char *, const char *);
+static int	 remote_remove(const char *, int);
+static void	 rmirror_dir(const char *, const char *, const char *, int,
+		    int);
+static int	 rmirror_entry(const char *, const char *, const char *,
+		    struct stat *, struct ftp_entry *, int, int);
+static int	 set_mode(int);
+
+static struct iobuf	*ctrl;
+static FILE		*data_fp;
+static char		*ctrl_host, *ctrl_port;
+static int		 ctrl_feats = -1, ctrl_modez;
+static int		 parallel = 1;
 
-static FILE	*ctrl_fp, *data_fp;
+/*
+ * With more_xfers set, the passive data connection for the next transfer
+ * is asked for while the current one drains: epsv_pending is set until
+ * the reply comes in behind the one ending the transfer and data_next is
+ * then connected, ready for data_fopen. no_epsv is set for a server where
+ * EPSV failed, EPRT is used straight away from then on.
+ */
+static int		 data_next = -1, epsv_pending, more_xfers, no_epsv;
+static int		 data_listen;
+static struct mirror_state *mirror_self;	/* mirror run by this process */
 
 static struct {
 	const char	 *name;
@@ -76,8 +149,15 @@ static struct {
 	{ "lcd", "change local working directory", do_lcd, 0 },
 	{ "lpwd", "print local working directory", do_lpwd, 0 },
 	{ "put", "send one file", do_put, 1 },
+	{ "reput", "resume sending a file", do_reput, 1 },
 	{ "mget", "get multiple files", do_mget, 1 },
 	{ "mput", "send multiple files", do_mget, 1 },
+	{ "mirror", "update local copy of remote directory tree",
+	    do_mirror, 1 },
+	{ "rmirror", "update remote copy of local directory tree",
+	    do_rmirror, 1 },
+	{ "parallel", "set number of concurrent transfers", do_parallel, 0 },
+	{ "modez", "set use of compressed transfers", do_modez, 0 },
 };
 
 static void
@@ -123,7 +203,7 @@ cmd(const char *host, const char *port, const char *path)
 		argv[2] = port ? (char *)port : "21";
 		do_open(3, argv);
 		/* If we don't have a connection, exit */
-		if (ctrl_fp == NULL)
+		if (ctrl == NULL)
 			exit(1);
 
 		if (path != NULL) {
@@ -165,7 +245,7 @@ cmd(const char *host, const char *port, const char *path)
 			continue;
 		}
 
-		if (cmd_tbl[i].conn_required && ctrl_fp == NULL) {
+		if (cmd_tbl[i].conn_required && ctrl == NULL) {
 			fprintf(stderr, "Not connected.\n");
 			continue;
 		}
@@ -205,7 +285,18 @@ data_fopen(const char *mode)
 {
 	int	 fd;
 
-	fd = activemode ? ftp_eprt(ctrl_fp) : ftp_epsv(ctrl_fp);
+	data_listen = 0;
+	if (data_next != -1) {
+		fd = data_next;
+		data_next = -1;
+	} else if (activemode || no_epsv || (fd = ftp_epsv(ctrl)) == -1) {
+		if (!activemode)
+			no_epsv = 1;
+
+		fd = ftp_eprt(ctrl);
+		data_listen = 1;
+	}
+
 	if (fd == -1) {
 		if (io_debug)
 			fprintf(stderr, "Failed to open data connection");
@@ -216,27 +307,103 @@ data_fopen(const char *mode)
 	return fdopen(fd, mode);
 }
 
+/*
+ * With EPRT the server connects once the transfer command is in, trade
+ * the listening socket for that connection.
+ */
+static void
+data_accept(const char *mode)
+{
+	FILE	*fp;
+	int	 s;
+
+	if (!data_listen)
+		return;
+
+	data_listen = 0;
+	if ((s = accept(fileno(data_fp), NULL, NULL)) == -1) {
+		warn("accept");
+		return;
+	}
+
+	if ((fp = fdopen(s, mode)) == NULL) {
+		warn("fdopen");
+		close(s);
+		return;
+	}
+
+	fclose(data_fp);
+	data_fp = fp;
+}
+
+/*
+ * Ask for the data connection of the next transfer if one is to follow,
+ * the server answers once the current transfer is over.
+ */
+static void
+data_prefetch(void)
+{
+	if (!more_xfers || activemode || no_epsv || data_next != -1 ||
+	    epsv_pending)
+		return;
+
+	ftp_send(ctrl, "EPSV");
+	epsv_pending = 1;
+}
+
+/*
+ * Read the reply ending a transfer and connect the data connection asked
+ * for meanwhile, if any.
+ */
+static int
+xfer_reply(void)
+{
+	char	*buf = NULL;
+	size_t	 n = 0;
+	int	 code;
+
+	code = ftp_getline(&buf, &n, 0, ctrl);
+	free(buf);
+	if (!epsv_pending)
+		return code;
+
+	epsv_pending = 0;
+	if ((data_next = ftp_epsv_reply(ctrl)) == -1)
+		no_epsv = 1;
+	else if (interrupted) {
+		close(data_next);
+		data_next = -1;
+	}
+
+	return code;
+}
+
 static void
 ftp_abort(void)
 {
 	char	buf[BUFSIZ];
 
+	/*
+	 * ABOR would only be read after the pending EPSV, closing the data
+	 * connection is what ends the transfer then.
+	 */
+	if (epsv_pending)
+		return;
+
 	snprintf(buf, sizeof buf, "%c%c%c", IAC, IP, IAC);
-	if (send(fileno(ctrl_fp), buf, 3, MSG_OOB) != 3)
+	if (send(ctrl->fd, buf, 3, MSG_OOB) != 3)
 		warn("abort");
 
-	ftp_command(ctrl_fp, "%cABOR", DM);
+	ftp_command(ctrl, "%cABOR", DM);
 }
 
 static void
 do_open(int argc, char **argv)
 {
 	const char	*host = NULL, *port = "21";
-	char		*buf = NULL;
-	size_t		 n = 0;
 	int		 sock;
 
-	if (ctrl_fp != NULL) {
+	if (ctrl != NULL) {
 		fprintf(stderr, "already connected, use close first.\n");
 		return;
 	}
@@ -256,17 +423,49 @@ do_open(int argc, char **argv)
 	if ((sock = tcp_connect(host, port, 0)) == -1)
 		return;
 
+	no_epsv = 0;
 	fprintf(stderr, "Connected to %s.\n", host);
-	if ((ctrl_fp = fdopen(sock, "r+")) == NULL)
-		err(1, "%s: fdopen", __func__);
+	if ((ctrl = ctrl_login(sock)) == NULL)
+		return;
+
+	/* for the extra sessions of parallel transfers */
+	ctrl_host = xstrdup(host);
+	ctrl_port = xstrdup(port);
+}
+
+/*
+ * Read the greeting on a new control connection and log in, returns
+ * NULL if that fails.
+ */
+static struct iobuf *
+ctrl_login(int sock)
+{
+	struct iobuf	*io;
+	char		*buf = NULL;
+	size_t		 n = 0;
+
+	io = iobuf_new(sock);
+	ctrl_feats = -1;
+	ctrl_modez = 0;
+	if (data_next != -1)
+		close(data_next);
+	data_next = -1;
+	epsv_pending = 0;
+
+	/* greeting, a 120 or 421 means there is no session for now */
+	if (ftp_getline(&buf, &n, 0, io) != P_OK) {
+		free(buf);
+		iobuf_free(io);
+		return NULL;
+	}
 
-	/* greeting */
-	ftp_getline(&buf, &n, 0, ctrl_fp);
 	free(buf);
-	if (ftp_auth(ctrl_fp, NULL, NULL) != P_OK) {
-		fclose(ctrl_fp);
-		ctrl_fp = NULL;
+	if (ftp_auth(io, NULL, NULL) != P_OK) {
+		iobuf_free(io);
+		return NULL;
 	}
+
+	return io;
 }
 
 static void
@@ -293,12 +492,15 @@ do_help(int argc, char **argv)
 static void
 do_quit(int argc, char **argv)
 {
-	if (ctrl_fp == NULL)
+	if (ctrl == NULL)
 		return;
 
-	ftp_command(ctrl_fp, "QUIT");
-	fclose(ctrl_fp);
-	ctrl_fp = NULL;
+	ftp_command(ctrl, "QUIT");
+	iobuf_free(ctrl);
+	ctrl = NULL;
+	free(ctrl_host);
+	free(ctrl_port);
+	ctrl_host = ctrl_port = NULL;
 }
 
 static void
@@ -326,6 +528,9 @@ do_ls(int argc, char **argv)
 		return;
 	}
 
+	if (set_mode(0) == -1)
+		return;
+
 	if ((data_fp = data_fopen("r")) == NULL)
 		return;
 
@@ -338,9 +543,9 @@ do_ls(int argc, char **argv)
 
 	cmd = (strcmp(argv[0], "ls") == 0) ? "LIST" : "NLST";
 	if (remote_dir != NULL)
-		r = ftp_command(ctrl_fp, "%s %s", cmd, remote_dir);
+		r = ftp_command(ctrl, "%s %s", cmd, remote_dir);
 	else
-		r = ftp_command(ctrl_fp, "%s", cmd);
+		r = ftp_command(ctrl, "%s", cmd);
 
 	if (r != P_PRE) {
 		fclose(data_fp);
@@ -351,6 +556,8 @@ do_ls(int argc, char **argv)
 		return;
 	}
 
+	data_accept("r");
+	data_prefetch();
 	while ((len = getline(&buf, &n, data_fp)) != -1 && !interrupted) {
 		buf[len - 1] = '\0';
 		if (len >= 2 && buf[len - 2] == '\r')
@@ -364,8 +571,8 @@ do_ls(int argc, char **argv)
 
 	fclose(data_fp);
 	data_fp = NULL;
-	ftp_getline(&buf, &n, 0, ctrl_fp);
 	free(buf);
+	(void)xfer_reply();
 	if (dst_fp != stdout)
 		fclose(dst_fp);
 }
@@ -373,11 +580,8 @@ do_ls(int argc, char **argv)
 static void
 do_get(int argc, char **argv)
 {
-	FILE		*dst_fp;
-	const char	*local_fname = NULL, *p, *remote_fname;
-	char		*buf = NULL;
-	size_t		 n = 0;
-	off_t		 file_sz, offset = 0;
+	const char	*local_fname = NULL, *remote_fname;
+	off_t		 offset = 0;
 
 	switch (argc) {
 	case 3:
@@ -394,38 +598,64 @@ do_get(int argc, char **argv)
 	if (local_fname == NULL)
 		local_fname = remote_fname;
 
-	if (ftp_command(ctrl_fp, "TYPE I") != P_OK)
-		return;
+	(void)get_file(remote_fname, local_fname, &offset);
+}
+
+/*
+ * Retrieve remote_fname into local_fname, offset counts the bytes as
+ * they arrive. Returns 0 if the server confirmed the transfer.
+ */
+static int
+get_file(const char *remote_fname, const char *local_fname, off_t *offset)
+{
+	FILE		*dst_fp;
+	const char	*p;
+	char		*buf = NULL;
+	off_t		 file_sz;
+	int		 code, z;
+
+	if (ftp_command(ctrl, "TYPE I") != P_OK)
+		return -1;
+
+	if ((z = xfer_mode()) == -1)
+		return -1;
 
 	log_info("local: %s remote: %s\n", local_fname, remote_fname);
-	if (ftp_size(ctrl_fp, remote_fname, &file_sz, &buf) != P_OK) {
+	if (ftp_size(ctrl, remote_fname, &file_sz, &buf) != P_OK) {
 		fprintf(stderr, "%s", buf);
-		return;
+		free(buf);
+		return -1;
 	}
 
 	if ((data_fp = data_fopen("r")) == NULL)
-		return;
+		return -1;
 
 	if ((dst_fp = fopen(local_fname, "w")) == NULL) {
 		warn("%s", local_fname);
 		fclose(data_fp);
 		data_fp = NULL;
-		return;
+		return -1;
 	}
 
-	if (ftp_command(ctrl_fp, "RETR %s", remote_fname) != P_PRE) {
+	if (ftp_command(ctrl, "RETR %s", remote_fname) != P_PRE) {
 		fclose(data_fp);
 		data_fp = NULL;
 		fclose(dst_fp);
-		return;
+		return -1;
 	}
 
+	data_accept("r");
+	data_prefetch();
 	if (progressmeter) {
 		p = basename(remote_fname);
-		start_progress_meter(p, NULL, file_sz, &offset);
+		start_progress_meter(p, NULL, file_sz, offset);
 	}
 
-	copy_file(dst_fp, data_fp, &offset);
+	if (z)
+		inflate_file(dst_fp, data_fp, offset);
+	else
+		copy_file(dst_fp, data_fp, -1, offset);
+
 	if (progressmeter)
 		stop_progress_meter();
 
@@ -435,14 +665,14 @@ do_get(int argc, char **argv)
 	fclose(data_fp);
 	data_fp = NULL;
 	fclose(dst_fp);
-	ftp_getline(&buf, &n, 0, ctrl_fp);
-	free(buf);
+	code = xfer_reply();
+	return (code == P_OK && !interrupted) ? 0 : -1;
 }
 
 static void
 do_pwd(int argc, char **argv)
 {
-	ftp_command(ctrl_fp, "PWD");
+	ftp_command(ctrl, "PWD");
 }
 
 static void
@@ -453,7 +683,7 @@ do_cd(int argc, char **argv)
 		return;
 	}
 
-	ftp_command(ctrl_fp, "CWD %s", argv[1]);
+	ftp_command(ctrl, "CWD %s", argv[1]);
 }
 
 static void
@@ -535,13 +765,41 @@ do_lpwd(int argc, char **argv)
 
 static void
 do_put(int argc, char **argv)
+{
+	const char	*local_fname, *remote_fname = NULL;
+	off_t		 offset = 0;
+
+	switch (argc) {
+	case 3:
+		remote_fname = argv[2];
+		/* FALLTHROUGH */
+	case 2:
+		local_fname = argv[1];
+		break;
+	default:
+		fprintf(stderr, "usage: put local-file [remote-file]\n");
+		return;
+	}
+
+	if (remote_fname == NULL)
+		remote_fname = local_fname;
+
+	(void)put_file(local_fname, remote_fname, &offset);
+}
+
+/*
+ * Send local-file as put does, carrying on from where the remote file
+ * ends. Nothing is sent if the remote file is as large and not older,
+ * all of it is if the local file changed since or is smaller.
+ */
+static void
+do_reput(int argc, char **argv)
 {
 	struct stat	 sb;
-	FILE		*src_fp;
-	const char	*local_fname, *p, *remote_fname = NULL;
+	const char	*local_fname, *remote_fname = NULL;
 	char		*buf = NULL;
-	size_t		 n = 0;
-	off_t		 file_sz, offset = 0;
+	off_t		 restart = 0;
+	time_t		 mtime = -1;
 
 	switch (argc) {
 	case 3:
@@ -551,49 +809,116 @@ do_put(int argc, char **argv)
 		local_fname = argv[1];
 		break;
 	default:
-		fprintf(stderr, "usage: put local-file [remote-file]\n");
+		fprintf(stderr, "usage: reput local-file [remote-file]\n");
 		return;
 	}
 
 	if (remote_fname == NULL)
 		remote_fname = local_fname;
 
-	if (ftp_command(ctrl_fp, "TYPE I") != P_OK)
+	if (stat(local_fname, &sb) == -1) {
+		warn("%s", local_fname);
+		return;
+	}
+
+	/* SIZE counts bytes in TYPE I only */
+	if (ftp_command(ctrl, "TYPE I") != P_OK)
 		return;
 
+	if (ftp_size(ctrl, remote_fname, &restart, &buf) != P_OK)
+		restart = 0;
+	else if (ftp_mdtm(ctrl, remote_fname, &mtime) == P_OK &&
+	    mtime != -1 && mtime < sb.st_mtime)
+		restart = 0;
+	else if (restart == sb.st_size) {
+		fprintf(stderr, "%s: remote file is current\n", remote_fname);
+		free(buf);
+		return;
+	} else if (restart > sb.st_size)
+		restart = 0;
+
+	free(buf);
+
+	/* the progress meter starts where the remote file ends */
+	(void)put_file_at(local_fname, remote_fname, restart, &restart);
+}
+
+static int
+put_file(const char *local_fname, const char *remote_fname, off_t *offset)
+{
+	if (ftp_command(ctrl, "TYPE I") != P_OK)
+		return -1;
+
+	return put_file_at(local_fname, remote_fname, 0, offset);
+}
+
+/*
+ * Store local_fname as remote_fname, from byte restart on if it isn't
+ * 0, with REST and STOR or with APPE if the server refuses REST. offset
+ * counts the bytes as they are sent. The session is expected in TYPE I.
+ * Returns 0 if the server confirmed the transfer.
+ */
+static int
+put_file_at(const char *local_fname, const char *remote_fname, off_t restart,
+    off_t *offset)
+{
+	struct stat	 sb;
+	FILE		*src_fp;
+	const char	*p;
+	off_t		 file_sz;
+	int		 code, z;
+
+	/* REST counts bytes of the file, not of the compressed stream */
+	if ((z = restart ? set_mode(0) : xfer_mode()) == -1)
+		return -1;
+
 	log_info("local: %s remote: %s\n", local_fname, remote_fname);
 	if ((data_fp = data_fopen("w")) == NULL)
-		return;
+		return -1;
 
 	if ((src_fp = fopen(local_fname, "r")) == NULL) {
 		warn("%s", local_fname);
 		fclose(data_fp);
 		data_fp = NULL;
-		return;
+		return -1;
 	}
 
-	if (fstat(fileno(src_fp), &sb) != 0) {
+	if (fstat(fileno(src_fp), &sb) != 0 ||
+	    fseeko(src_fp, restart, SEEK_SET) != 0) {
 		warn("%s", local_fname);
 		fclose(data_fp);
 		data_fp = NULL;
 		fclose(src_fp);
-		return;
+		return -1;
 	}
 	file_sz = sb.st_size;
 
-	if (ftp_command(ctrl_fp, "STOR %s", remote_fname) != P_PRE) {
+	if (restart == 0)
+		code = ftp_command(ctrl, "STOR %s", remote_fname);
+	else if (ftp_command(ctrl, "REST %lld", (long long)restart) == P_INTER)
+		code = ftp_command(ctrl, "STOR %s", remote_fname);
+	else
+		code = ftp_command(ctrl, "APPE %s", remote_fname);
+
+	if (code != P_PRE) {
 		fclose(data_fp);
 		data_fp = NULL;
 		fclose(src_fp);
-		return;
+		return -1;
 	}
 
+	data_accept("w");
+	data_prefetch();
 	if (progressmeter) {
 		p = basename(remote_fname);
-		start_progress_meter(p, NULL, file_sz, &offset);
+		start_progress_meter(p, NULL, file_sz, offset);
 	}
 
-	copy_file(data_fp, src_fp, &offset);
+	if (z)
+		deflate_file(data_fp, src_fp, offset);
+	else
+		copy_file(data_fp, src_fp, -1, offset);
+
 	if (progressmeter)
 		stop_progress_meter();
 
@@ -603,25 +928,23 @@ do_put(int argc, char **argv)
 	fclose(data_fp);
 	data_fp = NULL;
 	fclose(src_fp);
-	ftp_getline(&buf, &n, 0, ctrl_fp);
-	free(buf);
+	code = xfer_reply();
+	return (code == P_OK && !interrupted) ? 0 : -1;
 }
 
 static void
 do_mget(int argc, char **argv)
 {
-	void		(*fn)(int, char **);
+	int		(*fn)(const char *, const char *, off_t *);
 	const char	 *usage;
-	char		 *args[2];
-	int		  i;
+	off_t		  offset;
+	int		  get, i;
 
-	if (strcmp(argv[0], "mget") == 0) {
-		fn = do_get;
-		args[0] = "get";
+	if ((get = strcmp(argv[0], "mget") == 0)) {
+		fn = get_file;
 		usage = "mget remote-files";
 	} else {
-		fn = do_put;
-		args[0] = "put";
+		fn = put_file;
 		usage = "mput local-files";
 	}
 
@@ -630,8 +953,1000 @@ do_mget(int argc, char **argv)
 		return;
 	}
 
+	if (parallel > 1 && argc > 2) {
+		mxfer(fn, argc - 1, argv + 1, get);
+		return;
+	}
+
 	for (i = 1; i < argc && !interrupted; i++) {
-		args[1] = argv[i];
-		fn(2, args);
+		more_xfers = i < argc - 1;
+		offset = 0;
+		(void)fn(argv[i], argv[i], &offset);
+	}
+
+	/* left over by a file that failed before its transfer */
+	more_xfers = 0;
+	if (data_next != -1) {
+		close(data_next);
+		data_next = -1;
+	}
+}
+
+/*
+ * Run the transfers of an mget or mput in up to parallel processes,
+ * each logged in on a control connection of its own and in the same
+ * remote directory. Workers take the index of their next file off a
+ * pipe and leave its outcome and their byte count in shared memory,
+ * the byte counts add up to the aggregate progress meter.
+ */
+static void
+mxfer(int (*fn)(const char *, const char *, off_t *), int nfiles,
+    char **files, int get)
+{
+	struct stat	 sb;
+	char		*buf = NULL, *cwd, *title = NULL;
+	off_t		*counters, file_sz, sz, total;
+	pid_t		 pid;
+	int		*status, fds[2], failed, i, nworkers, running;
+
+	if (ftp_pwd(ctrl, &cwd) != P_OK) {
+		fprintf(stderr, "Can't get remote directory\n");
+		return;
+	}
+
+	/* the aggregate progress meter has to know the total up front */
+	sz = 0;
+	for (i = 0; progressmeter && i < nfiles; i++) {
+		if (get && ftp_size(ctrl, files[i], &file_sz, &buf) == P_OK)
+			sz += file_sz;
+		else if (!get && stat(files[i], &sb) == 0)
+			sz += sb.st_size;
+
+		free(buf);
+		buf = NULL;
+	}
+
+	nworkers = parallel < nfiles ? parallel : nfiles;
+	counters = mmap(NULL, nworkers * sizeof(*counters),
+	    PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED, -1, 0);
+	status = mmap(NULL, nfiles * sizeof(*status),
+	    PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED, -1, 0);
+	if (counters == MAP_FAILED || status == MAP_FAILED)
+		err(1, "%s: mmap", __func__);
+
+	/* ARGVMAX indices fit in the pipe, so they are all queued now */
+	if (pipe(fds) == -1)
+		err(1, "%s: pipe", __func__);
+
+	for (i = 0; i < nfiles; i++)
+		if (write(fds[1], &i, sizeof i) != sizeof i)
+			err(1, "%s: write", __func__);
+
+	close(fds[1]);
+	fflush(NULL);
+	for (running = 0; running < nworkers; running++) {
+		if ((pid = fork()) == -1) {
+			warn("%s: fork", __func__);
+			break;
+		}
+
+		if (pid == 0)
+			mxfer_worker(fn, files, fds[0], cwd,
+			    &counters[running], status);
+	}
+	close(fds[0]);
+
+	total = 0;
+	if (progressmeter) {
+		xasprintf(&title, "%d files", nfiles);
+		start_progress_meter(title, NULL, sz, &total);
+	}
+
+	while (running > 0) {
+		while (running > 0 && waitpid(WAIT_ANY, NULL, WNOHANG) > 0)
+			running--;
+
+		for (total = 0, i = 0; i < nworkers; i++)
+			total += counters[i];
+
+		if (running > 0)
+			(void)poll(NULL, 0, 100);
+	}
+
+	if (progressmeter) {
+		stop_progress_meter();
+		free(title);
+	}
+
+	for (failed = 0, i = 0; i < nfiles; i++) {
+		if (status[i] == 1)
+			continue;
+
+		fprintf(stderr, "%s: %s\n", files[i],
+		    status[i] == 0 ? "not transferred" : "transfer failed");
+		failed++;
+	}
+
+	if (failed)
+		fprintf(stderr, "%d of %d transfers failed\n", failed, nfiles);
+
+	munmap(counters, nworkers * sizeof(*counters));
+	munmap(status, nfiles * sizeof(*status));
+	free(cwd);
+}
+
+/*
+ * Transfer the files whose indices are read from qfd on a new session
+ * in cwd, marking each in status as done (1) or failed (-1). Errors
+ * are reported per file by the parent, the session output is muted.
+ */
+static void
+mxfer_worker(int (*fn)(const char *, const char *, off_t *), char **files,
+    int qfd, const char *cwd, off_t *counter, int *status)
+{
+	int	 i, sock;
+
+	verbose = 0;
+	progressmeter = 0;
+	iobuf_free(ctrl);
+	if ((sock = tcp_connect(ctrl_host, ctrl_port, 0)) == -1)
+		exit(1);
+
+	if ((ctrl = ctrl_login(sock)) == NULL)
+		exit(1);
+
+	if (ftp_command(ctrl, "CWD %s", cwd) != P_OK)
+		exit(1);
+
+	more_xfers = 1;
+	while (!interrupted && read(qfd, &i, sizeof i) == sizeof i)
+		status[i] = fn(files[i], files[i], counter) == 0 ? 1 : -1;
+
+	ftp_command(ctrl, "QUIT");
+	exit(0);
+}
+
+static void
+do_parallel(int argc, char **argv)
+{
+	const char	*errstr;
+	int		 n;
+
+	switch (argc) {
+	case 1:
+		break;
+	case 2:
+		n = strtonum(argv[1], 1, MAX_PARALLEL, &errstr);
+		if (errstr) {
+			fprintf(stderr, "parallel transfers %s: %s\n",
+			    errstr, argv[1]);
+			return;
+		}
+
+		parallel = n;
+		break;
+	default:
+		fprintf(stderr, "usage: parallel [transfers]\n");
+		return;
+	}
+
+	fprintf(stderr, "parallel transfers: %d\n", parallel);
+}
+
+static void
+do_modez(int argc, char **argv)
+{
+	const char	*names[] = { "auto", "off", "on" };
+	int		 m;
+
+	switch (argc) {
+	case 1:
+		break;
+	case 2:
+		if ((m = modez_lookup(argv[1])) != -1) {
+			modez = m;
+			break;
+		}
+
+		/* FALLTHROUGH */
+	default:
+		fprintf(stderr, "usage: modez [auto | on | off]\n");
+		return;
+	}
+
+	fprintf(stderr, "MODE Z is %s\n", names[modez]);
+}
+
+/*
+ * Pick the transfer mode for the next file as modez asks and the server
+ * allows, FEAT is sent once per session. Returns whether the transfer
+ * is compressed or -1.
+ */
+static int
+xfer_mode(void)
+{
+	int	 z;
+
+	if (ctrl_feats == -1 && modez != MODEZ_OFF)
+		ctrl_feats = ftp_feat(ctrl);
+
+	if ((z = ftp_modez(ctrl_feats == -1 ? 0 : ctrl_feats)) == -1) {
+		warnx("MODE Z not supported by %s", ctrl_host);
+		return -1;
+	}
+
+	if (set_mode(z) == 0)
+		return z;
+
+	/* a server may offer MODE Z and still refuse it, stay in MODE S */
+	if (z && modez != MODEZ_ON) {
+		ctrl_feats &= ~FEAT_MODEZ;
+		return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * Switch the session between MODE S and MODE Z, only if it isn't in
+ * that mode already.
+ */
+static int
+set_mode(int z)
+{
+	if (z == ctrl_modez)
+		return 0;
+
+	if (ftp_command(ctrl, "MODE %s", z ? "Z" : "S") != P_OK)
+		return -1;
+
+	ctrl_modez = z;
+	return 0;
+}
+
+/*
+ * Bring local-dir up to date with the tree under remote-dir. Files are
+ * fetched if their size or modification time differs, the latter is
+ * then copied to the local file so that the next run finds it current.
+ *
+ * With parallel above 1 directories are handed out to worker processes,
+ * each with a session of its own, see mirror_tree.
+ */
+static void
+do_mirror(int argc, char **argv)
+{
+	char	*lbase, *rbase;
+
+	switch (argc) {
+	case 2:
+	case 3:
+		break;
+	default:
+		fprintf(stderr, "usage: mirror remote-dir [local-dir]\n");
+		return;
+	}
+
+	if ((rbase = remote_abspath(argv[1])) == NULL)
+		return;
+
+	lbase = xstrdup(argc == 3 ? argv[2] : basename(argv[1]));
+	if (strcmp(lbase, "/") == 0 || strcmp(lbase, "..") == 0)
+		fprintf(stderr, "mirror: local-dir required for %s\n",
+		    argv[1]);
+	else
+		mirror_tree(rbase, lbase, 0);
+
+	free(lbase);
+	free(rbase);
+}
+
+/*
+ * Bring the tree under remote-dir up to date with local-dir, the
+ * reverse of mirror. Files are sent if the remote copy is missing, of
+ * another size or older, missing directories are made. With -d remote
+ * entries that local-dir lacks are removed.
+ */
+static void
+do_rmirror(int argc, char **argv)
+{
+	struct stat	 sb;
+	const char	*lbase, *rdir;
+	char		*rbase;
+	int		 flags = MIRROR_UP;
+
+	if (argc > 1 && strcmp(argv[1], "-d") == 0) {
+		flags |= MIRROR_DELETE;
+		argc--;
+		argv++;
+	}
+
+	switch (argc) {
+	case 2:
+	case 3:
+		break;
+	default:
+		fprintf(stderr, "usage: rmirror [-d] local-dir [remote-dir]\n");
+		return;
+	}
+
+	lbase = argv[1];
+	if (stat(lbase, &sb) == -1) {
+		warn("%s", lbase);
+		return;
+	}
+
+	if (!S_ISDIR(sb.st_mode)) {
+		fprintf(stderr, "rmirror: %s is not a directory\n", lbase);
+		return;
+	}
+
+	rdir = argc == 3 ? argv[2] : basename(lbase);
+	if (strcmp(rdir, "/") == 0 || strcmp(rdir, "..") == 0) {
+		fprintf(stderr, "rmirror: remote-dir required for %s\n",
+		    lbase);
+		return;
+	}
+
+	if ((rbase = remote_abspath(rdir)) == NULL)
+		return;
+
+	/* the workers make the directories below it */
+	(void)remote_cmd("MKD", rbase);
+	mirror_tree(rbase, lbase, flags);
+	free(rbase);
+}
+
+/*
+ * Remote paths are made absolute for the workers, they don't share the
+ * current directory of this session. Returns NULL if PWD fails.
+ */
+static char *
+remote_abspath(const char *path)
+{
+	char	*cwd, *rpath;
+
+	if (path[0] == '/')
+		return xstrdup(path);
+
+	if (ftp_pwd(ctrl, &cwd) != P_OK) {
+		fprintf(stderr, "Can't get remote directory\n");
+		return NULL;
+	}
+
+	rpath = path_join(cwd, path);
+	free(cwd);
+	return rpath;
+}
+
+/*
+ * Run a mirror, from rbase to lbase or the other way round with
+ * MIRROR_UP. A worker takes a directory, transfers what changed in it
+ * and reports back over a socketpair, one line per event:
+ *
+ *	d rel	subdirectory rel found, queued for a worker
+ *	g rel	file rel transferred
+ *	r rel	file or directory rel removed
+ *	e rel	file or directory rel failed
+ *	= n	directory done, n files were current
+ */
+static void
+mirror_tree(const char *rbase, const char *lbase, int flags)
+{
+	struct mirror_state	  ms;
+	struct pollfd		  pfds[MAX_PARALLEL];
+	struct iobuf		 *ios[MAX_PARALLEL];
+	char			 *line = NULL;
+	size_t			  n = 0;
+	ssize_t			  len;
+	int			  busy[MAX_PARALLEL], fds[2], i, nbusy;
+	int			  nworkers;
+
+	memset(&ms, 0, sizeof ms);
+	ms.verbose = verbose;
+	ms.qsize = 16;
+	ms.queue = xcalloc(ms.qsize, sizeof(*ms.queue));
+	ms.queue[ms.nqueue++] = xstrdup("");
+
+	/* a single worker would only log in again, this session does then */
+	fflush(NULL);
+	for (nworkers = 0; parallel > 1 && nworkers < parallel; nworkers++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+			warn("%s: socketpair", __func__);
+			break;
+		}
+
+		switch (fork()) {
+		case -1:
+			warn("%s: fork", __func__);
+			close(fds[0]);
+			close(fds[1]);
+			goto spawned;
+		case 0:
+			for (i = 0; i < nworkers; i++)
+				iobuf_free(ios[i]);
+
+			close(fds[0]);
+			mirror_worker(fds[1], rbase, lbase, flags);
+			/* NOTREACHED */
+		}
+
+		close(fds[1]);
+		ios[nworkers] = iobuf_new(fds[0]);
+		pfds[nworkers].fd = fds[0];
+		pfds[nworkers].events = POLLIN;
+		busy[nworkers] = 0;
+	}
+ spawned:
+	if (nworkers == 0)
+		mirror_local(&ms, rbase, lbase, flags);
+
+	for (nbusy = 0; nworkers > 0;) {
+		for (i = 0; i < nworkers && ms.qhead < ms.nqueue; i++) {
+			if (busy[i] || pfds[i].fd == -1)
+				continue;
+
+			/* a worker gone by now shows up as EOF below */
+			busy[i] = 1;
+			nbusy++;
+			len = xasprintf(&line, "%s\n", ms.queue[ms.qhead++]);
+			(void)iobuf_write(ios[i], line, len);
+			free(line);
+			line = NULL;
+		}
+
+		if (nbusy == 0)
+			break;
+
+		if (poll(pfds, nworkers, INFTIM) == -1) {
+			if (errno == EINTR)
+				continue;
+
+			err(1, "%s: poll", __func__);
+		}
+
+		for (i = 0; i < nworkers; i++) {
+			if (pfds[i].revents == 0)
+				continue;
+
+			/* all the complete lines, the read may block once */
+			do {
+				if ((len = iobuf_getline(ios[i], &line,
+				    &n)) == -1 || line[len - 1] != '\n') {
+					/* lost the worker and its directory */
+					pfds[i].fd = -1;
+					if (busy[i]) {
+						busy[i] = 0;
+						nbusy--;
+						ms.nfailed++;
+					}
+					break;
+				}
+
+				line[len - 1] = '\0';
+				if (mirror_event(&ms, line)) {
+					busy[i] = 0;
+					nbusy--;
+				}
+			} while (ios[i]->len > 0 && memchr(ios[i]->buf +
+			    ios[i]->off, '\n', ios[i]->len) != NULL);
+		}
+	}
+
+	/* workers quit on EOF */
+	for (i = 0; i < nworkers; i++)
+		iobuf_free(ios[i]);
+
+	while (waitpid(WAIT_ANY, NULL, 0) > 0)
+		continue;
+
+	if (ms.qhead < ms.nqueue)
+		fprintf(stderr, "%zu directories not mirrored\n",
+		    ms.nqueue - ms.qhead);
+
+	fprintf(stderr, "%d files %s, %d up to date, %d failed\n",
+	    ms.nxfered, (flags & MIRROR_UP) ? "sent" : "fetched", ms.nskipped,
+	    ms.nfailed);
+	if (flags & MIRROR_DELETE)
+		fprintf(stderr, "%d removed\n", ms.nremoved);
+
+	for (i = 0; i < (int)ms.nqueue; i++)
+		free(ms.queue[i]);
+
+	free(ms.queue);
+	free(line);
+}
+
+/*
+ * Account for the event line of a worker, returns 1 once its directory
+ * is done.
+ */
+static int
+mirror_event(struct mirror_state *ms, char *line)
+{
+	const char	*errstr;
+
+	switch (line[0]) {
+	case 'd':
+		if (ms->nqueue == ms->qsize) {
+			ms->queue = xreallocarray(ms->queue, ms->qsize * 2,
+			    sizeof(*ms->queue));
+			ms->qsize *= 2;
+		}
+		ms->queue[ms->nqueue++] = xstrdup(line + 2);
+		break;
+	case 'g':
+		ms->nxfered++;
+		if (ms->verbose)
+			fprintf(stderr, "%s\n", line + 2);
+		break;
+	case 'r':
+		ms->nremoved++;
+		if (ms->verbose)
+			fprintf(stderr, "%s: removed\n", line + 2);
+		break;
+	case 'e':
+		ms->nfailed++;
+		fprintf(stderr, "%s: transfer failed\n", line + 2);
+		break;
+	case '=':
+		ms->nskipped += strtonum(line + 2, 0, INT_MAX, &errstr);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Mirror the queued directories on this session, as the only worker.
+ * It is quiet like the worker processes, events go to mirror_event()
+ * straight away.
+ */
+static void
+mirror_local(struct mirror_state *ms, const char *rbase, const char *lbase,
+    int flags)
+{
+	const char	*rel;
+	int		 saved_progress, saved_verbose;
+
+	saved_progress = progressmeter;
+	saved_verbose = verbose;
+	progressmeter = 0;
+	verbose = 0;
+	mirror_self = ms;
+	while (!interrupted && ms->qhead < ms->nqueue) {
+		/* the queue may grow and move meanwhile, rel stays */
+		rel = ms->queue[ms->qhead++];
+		if (flags & MIRROR_UP)
+			rmirror_dir(rbase, lbase, rel, -1, flags);
+		else
+			mirror_dir(rbase, lbase, rel, -1);
+	}
+
+	mirror_self = NULL;
+	progressmeter = saved_progress;
+	verbose = saved_verbose;
+}
+
+/*
+ * Report an event on fd, or to mirror_event() if it is -1 and the mirror
+ * runs in this process.
+ */
+static void
+mirror_report(int fd, const char *fmt, ...)
+{
+	va_list	 ap;
+	char	*line;
+
+	va_start(ap, fmt);
+	if (fd != -1)
+		(void)vdprintf(fd, fmt, ap);
+	else {
+		if (vasprintf(&line, fmt, ap) == -1)
+			err(1, "%s: vasprintf", __func__);
+
+		line[strcspn(line, "\n")] = '\0';
+		(void)mirror_event(mirror_self, line);
+		free(line);
+	}
+	va_end(ap);
+}
+
+/*
+ * Log in on a session of its own and mirror the directories, relative
+ * to rbase and lbase, read off fd until the parent closes it.
+ */
+static void
+mirror_worker(int fd, const char *rbase, const char *lbase, int flags)
+{
+	struct iobuf	*io;
+	char		*rel = NULL;
+	size_t		 n = 0;
+	ssize_t		 len;
+	int		 sock;
+
+	verbose = 0;
+	progressmeter = 0;
+	iobuf_free(ctrl);
+	if ((sock = tcp_connect(ctrl_host, ctrl_port, 0)) == -1)
+		exit(1);
+
+	if ((ctrl = ctrl_login(sock)) == NULL)
+		exit(1);
+
+	more_xfers = 1;
+	io = iobuf_new(fd);
+	while (!interrupted && (len = iobuf_getline(io, &rel, &n)) != -1) {
+		rel[len - 1] = '\0';
+		if (flags & MIRROR_UP)
+			rmirror_dir(rbase, lbase, rel, fd, flags);
+		else
+			mirror_dir(rbase, lbase, rel, fd);
+	}
+
+	ftp_command(ctrl, "QUIT");
+	exit(0);
+}
+
+/*
+ * Mirror the files in directory rel and report them and the
+ * subdirectories on fd.
+ */
+static void
+mirror_dir(const char *rbase, const char *lbase, const char *rel, int fd)
+{
+	struct ftp_entry	*ents;
+	char			*lpath, *rpath;
+	int			 i, nents, nskipped = 0;
+
+	rpath = path_join(rbase, rel);
+	lpath = path_join(lbase, rel);
+	nents = list_dir(rpath, &ents);
+	if (nents != -1 && mkdir(lpath, 0777) == -1 && errno != EEXIST) {
+		warn("%s", lpath);
+		for (i = 0; i < nents; i++)
+			free(ents[i].name);
+		free(ents);
+		nents = -1;
+	}
+	free(rpath);
+	free(lpath);
+
+	if (nents == -1)
+		mirror_report(fd, "e %s\n", *rel ? rel : ".");
+
+	for (i = 0; i < nents; i++) {
+		if (!interrupted && ents[i].type == FT_DIR) {
+			rpath = path_join(rel, ents[i].name);
+			mirror_report(fd, "d %s\n", rpath);
+			free(rpath);
+		} else if (!interrupted)
+			nskipped += mirror_file(rbase, lbase, rel, &ents[i], fd);
+
+		free(ents[i].name);
+	}
+
+	if (nents != -1)
+		free(ents);
+
+	mirror_report(fd, "= %d\n", nskipped);
+}
+
+/*
+ * Fetch the file ent in directory rel unless the local copy has the
+ * same size and modification time, returns 1 if it was current.
+ */
+static int
+mirror_file(const char *rbase, const char *lbase, const char *rel,
+    struct ftp_entry *ent, int fd)
+{
+	struct stat	 sb;
+	struct timeval	 tv[2];
+	char		*lpath, *path, *rpath;
+	off_t		 offset = 0;
+	int		 current = 0;
+
+	path = path_join(rel, ent->name);
+	rpath = path_join(rbase, path);
+	lpath = path_join(lbase, path);
+
+	/* LIST has no usable time, ask for it */
+	if (ent->mtime == -1)
+		(void)ftp_mdtm(ctrl, rpath, &ent->mtime);
+
+	if (stat(lpath, &sb) == 0 && S_ISREG(sb.st_mode) &&
+	    sb.st_size == ent->size &&
+	    (ent->mtime == -1 || sb.st_mtime == ent->mtime))
+		current = 1;
+	else if (get_file(rpath, lpath, &offset) == 0) {
+		if (ent->mtime != -1) {
+			tv[0].tv_sec = tv[1].tv_sec = ent->mtime;
+			tv[0].tv_usec = tv[1].tv_usec = 0;
+			if (utimes(lpath, tv) == -1)
+				warn("utimes %s", lpath);
+		}
+		mirror_report(fd, "g %s\n", path);
+	} else
+		mirror_report(fd, "e %s\n", path);
+
+	free(rpath);
+	free(lpath);
+	free(path);
+	return current;
+}
+
+/*
+ * Send the files of local directory rel that are missing or changed on
+ * the remote side, make the missing subdirectories and report them on
+ * fd. With MIRROR_DELETE remote entries without a local one go.
+ */
+static void
+rmirror_dir(const char *rbase, const char *lbase, const char *rel, int fd,
+    int flags)
+{
+	struct ftp_entry	*ent, *ents = NULL, key;
+	struct dirent		*dp;
+	struct stat		 sb;
+	DIR			*dirp;
+	char			*lpath, *path, *rpath, *seen;
+	int			 i, nents = -1, nskipped = 0;
+
+	lpath = path_join(lbase, rel);
+	rpath = path_join(rbase, rel);
+	if ((dirp = opendir(lpath)) == NULL)
+		warn("%s", lpath);
+	else if ((nents = list_dir(rpath, &ents)) == -1)
+		closedir(dirp);
+	free(rpath);
+	free(lpath);
+
+	if (nents == -1) {
+		mirror_report(fd, "e %s\n", *rel ? rel : ".");
+		mirror_report(fd, "= 0\n");
+		return;
+	}
+
+	/* entries are matched by name, a remote one left unseen is extra */
+	qsort(ents, nents, sizeof(*ents), entry_cmp);
+	seen = xcalloc(nents + 1, 1);
+	while (!interrupted && (dp = readdir(dirp)) != NULL) {
+		if (strcmp(dp->d_name, ".") == 0 ||
+		    strcmp(dp->d_name, "..") == 0)
+			continue;
+
+		/* can't go in a command line, nor in a report */
+		if (strpbrk(dp->d_name, "\r\n") != NULL)
+			continue;
+
+		path = path_join(rel, dp->d_name);
+		lpath = path_join(lbase, path);
+		key.name = dp->d_name;
+		if ((ent = bsearch(&key, ents, nents, sizeof(*ents),
+		    entry_cmp)) != NULL)
+			seen[ent - ents] = 1;
+
+		/* neither links nor special files are sent */
+		if (lstat(lpath, &sb) == -1) {
+			warn("%s", lpath);
+			mirror_report(fd, "e %s\n", path);
+		} else if (S_ISDIR(sb.st_mode) || S_ISREG(sb.st_mode))
+			nskipped += rmirror_entry(rbase, lbase, path, &sb,
+			    ent, fd, flags);
+
+		free(lpath);
+		free(path);
+	}
+	closedir(dirp);
+
+	for (i = 0; i < nents; i++) {
+		if ((flags & MIRROR_DELETE) && !seen[i] && !interrupted) {
+			path = path_join(rel, ents[i].name);
+			rpath = path_join(rbase, path);
+			mirror_report(fd, "%c %s\n",
+			    remote_remove(rpath, ents[i].type) == 0 ? 'r' : 'e',
+			    path);
+			free(rpath);
+			free(path);
+		}
+		free(ents[i].name);
+	}
+
+	free(ents);
+	free(seen);
+	mirror_report(fd, "= %d\n", nskipped);
+}
+
+/*
+ * Bring the remote copy of the local file or directory path, ent if it
+ * exists, up to date. A file is current if it has the same size and
+ * isn't older, the time is copied to the remote file with MFMT after
+ * sending it where the server allows. Returns 1 if it was current.
+ */
+static int
+rmirror_entry(const char *rbase, const char *lbase, const char *path,
+    struct stat *sb, struct ftp_entry *ent, int fd, int flags)
+{
+	struct tm	*tm;
+	char		*lpath, *rpath, mfmt[32];
+	off_t		 offset = 0;
+	int		 current = 0, isdir;
+
+	rpath = path_join(rbase, path);
+	lpath = path_join(lbase, path);
+	isdir = S_ISDIR(sb->st_mode);
+
+	/* a file where a directory goes or the other way round */
+	if (ent != NULL && (ent->type == FT_DIR) != isdir) {
+		if (!(flags & MIRROR_DELETE) ||
+		    remote_remove(rpath, ent->type) == -1) {
+			mirror_report(fd, "e %s\n", path);
+			goto done;
+		}
+		ent = NULL;
+	}
+
+	/* LIST has no usable time, ask for it */
+	if (!isdir && ent != NULL && ent->size == sb->st_size &&
+	    ent->mtime == -1)
+		(void)ftp_mdtm(ctrl, rpath, &ent->mtime);
+
+	if (isdir) {
+		if (ent == NULL && remote_cmd("MKD", rpath) == -1)
+			mirror_report(fd, "e %s\n", path);
+		else
+			mirror_report(fd, "d %s\n", path);
+	} else if (ent != NULL && ent->size == sb->st_size &&
+	    (ent->mtime == -1 || ent->mtime >= sb->st_mtime))
+		current = 1;
+	else if (put_file(lpath, rpath, &offset) == 0) {
+		if ((tm = gmtime(&sb->st_mtime)) != NULL &&
+		    strftime(mfmt, sizeof mfmt, "MFMT %Y%m%d%H%M%S", tm) != 0)
+			(void)remote_cmd(mfmt, rpath);
+		mirror_report(fd, "g %s\n", path);
+	} else
+		mirror_report(fd, "e %s\n", path);
+
+ done:
+	free(rpath);
+	free(lpath);
+	return current;
+}
+
+/*
+ * Remove the remote file or directory rpath, a directory along with
+ * all it holds.
+ */
+static int
+remote_remove(const char *rpath, int type)
+{
+	struct ftp_entry	*ents;
+	char			*path;
+	int			 i, nents, r = 0;
+
+	if (type != FT_DIR)
+		return remote_cmd("DELE", rpath);
+
+	if ((nents = list_dir(rpath, &ents)) == -1)
+		return -1;
+
+	for (i = 0; i < nents; i++) {
+		if (r == 0 && !interrupted) {
+			path = path_join(rpath, ents[i].name);
+			r = remote_remove(path, ents[i].type);
+			free(path);
+		}
+		free(ents[i].name);
+	}
+
+	free(ents);
+	return r == 0 ? remote_cmd("RMD", rpath) : -1;
+}
+
+/*
+ * Send "cmd path" on the quiet, the outcome is for the caller to report.
+ * Returns -1 unless the server completed it.
+ */
+static int
+remote_cmd(const char *cmd, const char *path)
+{
+	char	*buf = NULL, *line;
+	size_t	 n = 0;
+	int	 code;
+
+	xasprintf(&line, "%s %s", cmd, path);
+	ftp_send(ctrl, line);
+	free(line);
+	code = ftp_getline(&buf, &n, 1, ctrl);
+	free(buf);
+	return code == P_OK ? 0 : -1;
+}
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+	const struct ftp_entry	*ea = a, *eb = b;
+
+	return strcmp(ea->name, eb->name);
+}
+
+/*
+ * List the regular files and subdirectories of rdir into *entsp. MLSD
+ * is tried first, LIST is parsed if the server doesn't know MLSD.
+ * Returns the number of entries or -1.
+ */
+static int
+list_dir(const char *rdir, struct ftp_entry **entsp)
+{
+	static int		 no_mlsd;
+	struct ftp_entry	 ent, *ents = NULL;
+	char			*buf = NULL;
+	size_t			 n = 0;
+	int			 i, mlsd, nents = 0, r;
+
+	if (set_mode(0) == -1)
+		return -1;
+
+	if ((data_fp = data_fopen("r")) == NULL)
+		return -1;
+
+	mlsd = !no_mlsd;
+	if (ftp_command(ctrl, "%s %s", mlsd ? "MLSD" : "LIST", rdir) != P_PRE) {
+		fclose(data_fp);
+		data_fp = NULL;
+		if (!mlsd)
+			return -1;
+
+		/* LIST has to work where MLSD failed to blame MLSD */
+		no_mlsd = 1;
+		if ((nents = list_dir(rdir, entsp)) == -1)
+			no_mlsd = 0;
+
+		return nents;
+	}
+
+	data_accept("r");
+	data_prefetch();
+	while (getline(&buf, &n, data_fp) != -1 && !interrupted) {
+		buf[strcspn(buf, "\r\n")] = '\0';
+		r = mlsd ? ftp_parse_mlsd(buf, &ent) :
+		    ftp_parse_list(buf, &ent);
+
+		/* names from the server must not lead out of the tree */
+		if (r == -1 || ent.type == FT_OTHER ||
+		    strcmp(ent.name, ".") == 0 || strcmp(ent.name, "..") == 0 ||
+		    strchr(ent.name, '/') != NULL)
+			continue;
+
+		ents = xreallocarray(ents, nents + 1, sizeof(*ents));
+		ents[nents] = ent;
+		ents[nents++].name = xstrdup(ent.name);
+	}
+
+	fclose(data_fp);
+	data_fp = NULL;
+	free(buf);
+	if ((r = xfer_reply()) != P_OK || interrupted) {
+		for (i = 0; i < nents; i++)
+			free(ents[i].name);
+		free(ents);
+		return -1;
 	}
+
+	*entsp = ents;
+	return nents;
+}
+
+static char *
+path_join(const char *dir, const char *name)
+{
+	char	*path;
+
+	if (*dir == '\0')
+		return xstrdup(name);
+
+	if (*name == '\0')
+		return xstrdup(dir);
+
+	xasprintf(&path, "%s%s%s", dir,
+	    dir[strlen(dir) - 1] == '/' ? "" : "/", name);
+	return path;
 }
@@ -14,16 +14,30 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE	/* copy_file_range(2) */
+#endif
+
 #include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #include "ftp.h"
 
+#define COPY_CHUNK	(8 * 1024 * 1024)
+
 struct imsgbuf;
 
+static int	 file_copy_kernel(FILE *, off_t *);
+
 static FILE	*src_fp;
 
 struct url *
@@ -50,6 +64,81 @@ file_request(struct imsgbuf *ibuf, struct url *url, off_t *offset, off_t *sz)
 void
 file_save(struct url *url, FILE *dst_fp, off_t *offset)
 {
-	copy_file(dst_fp, src_fp, offset);
+	if (file_copy_kernel(dst_fp, offset) == -1)
+		copy_file(dst_fp, src_fp, -1, offset);
+
 	fclose(src_fp);
 }
+
+/*
+ * Fill a regular destination file from the source without moving the
+ * data through a userland buffer, starting at the resume offset. On
+ * Linux the extents are shared with a reflink where the filesystem
+ * supports it, copied with copy_file_range(2) otherwise. Elsewhere
+ * the source is mapped and written out by fd_sendfile(). Returns -1
+ * if none of these applies and nothing was copied, the caller falls
+ * back to copy_file() then.
+ */
+static int
+file_copy_kernel(FILE *dst_fp, off_t *offset)
+{
+	struct stat		 sb, dsb;
+	int			 dst, src;
+#ifdef __linux__
+	struct file_clone_range	 fcr;
+	off_t			 in, out;
+	ssize_t			 r;
+	int			 flags, ret = 0;
+#endif
+
+	src = fileno(src_fp);
+	dst = fileno(dst_fp);
+	if (fstat(src, &sb) == -1 || fstat(dst, &dsb) == -1 ||
+	    !S_ISREG(sb.st_mode) || !S_ISREG(dsb.st_mode))
+		return -1;
+
+	if (fflush(dst_fp) == EOF)
+		err(1, "%s: fflush", __func__);
+
+#ifdef __linux__
+	/* a resumed file is opened O_APPEND, which both calls reject */
+	if ((flags = fcntl(dst, F_GETFL)) == -1 ||
+	    fcntl(dst, F_SETFL, flags & ~O_APPEND) == -1)
+		return -1;
+
+	in = out = *offset;
+	fcr.src_fd = src;
+	fcr.src_offset = in;
+	fcr.src_length = 0;	/* up to EOF */
+	fcr.dest_offset = out;
+	if (ioctl(dst, FICLONERANGE, &fcr) == 0) {
+		*offset = sb.st_size;
+		goto done;
+	}
+
+	while (!interrupted &&
+	    (r = copy_file_range(src, &in, dst, &out, COPY_CHUNK, 0)) != 0) {
+		if (r == -1 && errno == EINTR)
+			continue;
+
+		if (r == -1 && out == fcr.dest_offset && (errno == EXDEV ||
+		    errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+			ret = -1;
+			break;
+		}
+
+		if (r == -1)
+			err(1, "%s: copy_file_range", __func__);
+
+		*offset += r;
+	}
+
+ done:
+	if (fcntl(dst, F_SETFL, flags) == -1)
+		err(1, "%s: fcntl", __func__);
+
+	return ret;
+#else
+	return fd_sendfile(dst, src, -1, offset) == -1 ? -1 : 0;
+#endif
+}
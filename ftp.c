@@ -24,22 +24,46 @@
 #include <libgen.h>
 #include <limits.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "ftp.h"
 #include "xmalloc.h"
 
-static FILE	*ctrl_fp;
-static int	 data_fd;
+static int	 epsv_connect(struct iobuf *, char *);
+static int	 feat_reply(struct iobuf *);
+static void	 ftp_disconnect(void);
+static int	 ftp_reuse(struct url *);
+static void	 ftp_sendv(struct iobuf *, char **, int);
+static off_t	 size_from_reply(const char *);
+static time_t	 time_parse(const char *);
+
+/*
+ * The control connection outlives a transfer and is reused by the next
+ * URL for the same server, ctrl_key identifies it, ctrl_binary is
+ * set once TYPE I was accepted on it and ctrl_cwd is its directory.
+ * ctrl_feats is the FEAT_* mask of the server, -1 until asked, and
+ * ctrl_modez is set while the session is in MODE Z.
+ * Segment processes inherit it, only ctrl_pid may end the session.
+ * no_epsv outlives sessions, it is set once EPSV failed on ctrl_key.
+ */
+static struct iobuf	*ctrl;
+static char		*ctrl_cwd;
+static char		*ctrl_key;
+static pid_t		 ctrl_pid;
+static int		 ctrl_binary, ctrl_feats = -1, ctrl_modez;
+static int		 data_fd = -1, data_listen, data_modez;
+static int		 no_epsv;
 
 void
 ftp_connect(struct url *url, struct url *proxy, int timeout)
 {
-	char		*buf = NULL;
+	char		*buf = NULL, *key;
 	size_t		 n = 0;
 	int		 sock;
 
@@ -48,47 +72,82 @@ ftp_connect(struct url *url, struct url *proxy, int timeout)
 		return;
 	}
 
+	if (ftp_reuse(url))
+		return;
+
+	free(ctrl_cwd);
+	ctrl_cwd = NULL;
+	ctrl_binary = ctrl_modez = 0;
+	ctrl_feats = -1;
 	if ((sock = tcp_connect(url->host, url->port, timeout)) == -1)
 		exit(1);
 
-	if ((ctrl_fp = fdopen(sock, "r+")) == NULL)
-		err(1, "%s: fdopen", __func__);
+	/* first session, say goodbye to the server whichever way we exit */
+	if (ctrl_key == NULL)
+		atexit(ftp_disconnect);
+
+	ctrl = iobuf_new(sock);
+	ctrl_pid = getpid();
+	xasprintf(&key, "%s:%s", url->host, url->port);
+	if (ctrl_key == NULL || strcmp(ctrl_key, key) != 0)
+		no_epsv = 0;
+
+	free(ctrl_key);
+	ctrl_key = key;
 
 	/* greeting */
-	if (ftp_getline(&buf, &n, 0, ctrl_fp) != P_OK) {
+	if (ftp_getline(&buf, &n, 0, ctrl) != P_OK) {
 		warnx("Can't connect to host `%s'", url->host);
-		ftp_command(ctrl_fp, "QUIT");
 		exit(1);
 	}
 
 	free(buf);
 	log_info("Connected to %s\n", url->host);
-	if (ftp_auth(ctrl_fp, NULL, NULL) != P_OK) {
+	if (ftp_auth(ctrl, NULL, NULL) != P_OK) {
 		warnx("Can't login to host `%s'", url->host);
-		ftp_command(ctrl_fp, "QUIT");
 		exit(1);
 	}
 }
 
 struct url *
-ftp_get(struct url *url, struct url *proxy, off_t *offset, off_t *sz)
+ftp_get(struct url *url, struct url *proxy, int timeout, off_t *offset,
+    off_t *sz)
 {
-	char	*buf = NULL, *dir, *file;
+	char	*buf = NULL, *cmds[6], *dir, *file;
+	size_t	 n = 0;
+	int	 code, i, ncmds = 0, z;
+	int	 cwd_cmd = -1, epsv_cmd = -1, feat_cmd = -1, mode_cmd = -1;
+	int	 rest_cmd = -1, size_cmd, type_cmd = -1;
+	int	 rest_ok = 0;
 
 	if (proxy) {
-		url = http_get(url, proxy, offset, sz);
+		url = http_get(url, proxy, timeout, offset, sz);
 		/* this url should now be treated as HTTP */
 		url->scheme = S_HTTP;
 		return url;
 	}
 
-	log_info("Using binary mode to transfer files.\n");
-	if (ftp_command(ctrl_fp, "TYPE I") != P_OK)
-		errx(1, "Failed to set mode to binary");
-
+	/*
+	 * The commands up to the data connection don't depend on each
+	 * other's outcome, send them in one go and match the replies in
+	 * order. CWD is left out if the session is already there.
+	 */
 	dir = dirname(url->path);
-	if (ftp_command(ctrl_fp, "CWD %s", dir) != P_OK)
-		errx(1, "CWD command failed");
+	if (!ctrl_binary) {
+		log_info("Using binary mode to transfer files.\n");
+		type_cmd = ncmds;
+		cmds[ncmds++] = xstrdup("TYPE I");
+	}
+
+	if (ctrl_feats == -1 && modez != MODEZ_OFF) {
+		feat_cmd = ncmds;
+		cmds[ncmds++] = xstrdup("FEAT");
+	}
+
+	if (ctrl_cwd == NULL || strcmp(ctrl_cwd, dir) != 0) {
+		cwd_cmd = ncmds;
+		xasprintf(&cmds[ncmds++], "CWD %s", dir);
+	}
 
 	log_info("Retrieving %s\n", url->path);
 	file = basename(url->path);
@@ -97,29 +156,114 @@ ftp_get(struct url *url, struct url *proxy, off_t *offset, off_t *sz)
 	else
 		log_info("remote: %s\n", file);
 
-	if (ftp_size(ctrl_fp, file, sz, &buf) != P_OK) {
-		fprintf(stderr, "%s", buf);
-		ftp_command(ctrl_fp, "QUIT");
-		exit(1);
+	size_cmd = ncmds;
+	xasprintf(&cmds[ncmds++], "SIZE %s", file);
+	if (!activemode && !no_epsv) {
+		epsv_cmd = ncmds;
+		cmds[ncmds++] = xstrdup("EPSV");
 	}
-	free(buf);
 
-	if (activemode)
-		data_fd = ftp_eprt(ctrl_fp);
-	else if ((data_fd = ftp_epsv(ctrl_fp)) == -1)
-		data_fd = ftp_eprt(ctrl_fp);
+	ftp_sendv(ctrl, cmds, ncmds);
+	data_fd = -1;
+	for (i = 0; i < ncmds; i++) {
+		free(cmds[i]);
+		if (i == feat_cmd) {
+			ctrl_feats = feat_reply(ctrl);
+			continue;
+		}
+
+		code = ftp_getline(&buf, &n, i == size_cmd || i == epsv_cmd,
+		    ctrl);
+		if (i == type_cmd) {
+			if (code != P_OK)
+				errx(1, "Failed to set mode to binary");
+
+			ctrl_binary = 1;
+		} else if (i == cwd_cmd) {
+			if (code != P_OK)
+				errx(1, "CWD command failed");
+
+			free(ctrl_cwd);
+			ctrl_cwd = xstrdup(dir);
+		} else if (i == size_cmd) {
+			/* not fatal, RETR tells if the file is there */
+			if (code == P_OK &&
+			    sscanf(buf, "%*u %lld", sz) != 1)
+				errx(1, "%s: sscanf size", __func__);
+		} else if (i == epsv_cmd) {
+			if (code == P_OK)
+				data_fd = epsv_connect(ctrl, buf);
+
+			/* don't bother this server with EPSV again */
+			no_epsv = data_fd == -1;
+		}
+	}
 
-	if (data_fd == -1)
+	/* with EPRT data_fd listens for the server to connect */
+	if ((data_listen = data_fd == -1) && (data_fd = ftp_eprt(ctrl)) == -1)
 		errx(1, "Failed to establish data connection");
 
-	if (*offset && ftp_command(ctrl_fp, "REST %lld", *offset) != P_INTER)
-		errx(1, "REST command failed");
+	/* resumed and segmented transfers go in MODE S, REST is a byte offset */
+	z = 0;
+	if (*offset == 0 &&
+	    (z = ftp_modez(ctrl_feats == -1 ? 0 : ctrl_feats)) == -1)
+		errx(1, "%s doesn't support MODE Z", url->host);
+
+	ncmds = 0;
+	if (z != ctrl_modez) {
+		mode_cmd = ncmds;
+		xasprintf(&cmds[ncmds++], "MODE %s", z ? "Z" : "S");
+	}
+
+	/*
+	 * REST must come right before RETR. With -j a REST 0 also probes
+	 * for the REST support segmented transfers depend on.
+	 */
+	if (*offset || segments > 1) {
+		rest_cmd = ncmds;
+		xasprintf(&cmds[ncmds++], "REST %lld", *offset);
+	}
+
+	xasprintf(&cmds[ncmds++], "RETR %s", file);
+	ftp_sendv(ctrl, cmds, ncmds);
+	for (i = 0; i < ncmds; i++)
+		free(cmds[i]);
+
+	/*
+	 * A server may offer MODE Z and still refuse it. RETR then goes
+	 * in MODE S, unless MODE Z was asked for explicitly.
+	 */
+	if (mode_cmd != -1) {
+		if (ftp_getline(&buf, &n, 0, ctrl) == P_OK)
+			ctrl_modez = z;
+		else if (z && modez != MODEZ_ON) {
+			log_info("MODE Z refused, using MODE S\n");
+			ctrl_feats &= ~FEAT_MODEZ;
+			z = 0;
+		} else
+			errx(1, "MODE command failed");
+	}
 
-	if (ftp_command(ctrl_fp, "RETR %s", file) != P_PRE) {
-		ftp_command(ctrl_fp, "QUIT");
+	if (rest_cmd != -1) {
+		rest_ok = ftp_getline(&buf, &n, 0, ctrl) == P_INTER;
+		if (*offset && !rest_ok)
+			errx(1, "REST command failed");
+	}
+
+	if (ftp_getline(&buf, &n, 1, ctrl) != P_PRE) {
+		fprintf(stderr, "%s", buf);
 		exit(1);
 	}
 
+	log_info("%s", buf);
+	/* the size in the 150 reply may be what is left after REST */
+	if (*sz == 0 && *offset == 0)
+		*sz = size_from_reply(buf);
+
+	free(buf);
+	data_modez = z;
+	url->ranges = !z && rest_ok && *sz > 0;
+	timing_mark(TIMING_FIRSTBYTE);
 	return url;
 }
 
@@ -131,7 +275,7 @@ ftp_save(struct url *url, FILE *dst_fp, off_t *offset)
 	socklen_t		 len;
 	int			 s;
 
-	if (activemode) {
+	if (data_listen) {
 		len = sizeof(ss);
 		if ((s = accept(data_fd, (struct sockaddr *)&ss, &len)) == -1)
 			err(1, "%s: accept", __func__);
@@ -143,26 +287,129 @@ ftp_save(struct url *url, FILE *dst_fp, off_t *offset)
 	if ((data_fp = fdopen(data_fd, "r")) == NULL)
 		err(1, "%s: fdopen data_fd", __func__);
 
-	copy_file(dst_fp, data_fp, offset);
+	/* a segment ends at its range, before the end of the file */
+	if (data_modez)
+		inflate_file(dst_fp, data_fp, offset);
+	else
+		copy_file(dst_fp, data_fp,
+		    url->content_length > 0 ? url->content_length : -1, offset);
 	fclose(data_fp);
+	data_fd = -1;
+}
+
+/*
+ * Retrieve the len bytes at start of the file on a session of its own.
+ * This runs in a segment process, the inherited session carries the
+ * first range and is left alone. Once the range is in the transfer is
+ * aborted, the session is ended at exit.
+ */
+void
+ftp_save_range(struct url *url, int timeout, off_t start, off_t len,
+    FILE *dst_fp, off_t *offset)
+{
+	off_t	 sz = 0;
+
+	if (data_fd != -1)
+		close(data_fd);
+
+	data_fd = -1;
+	iobuf_free(ctrl);
+	ctrl = NULL;
+	ftp_connect(url, NULL, timeout);
+	url->content_length = len;
+	ftp_get(url, NULL, timeout, &start, &sz);
+	ftp_save(url, dst_fp, offset);
+	ftp_send(ctrl, "ABOR");
 }
 
+/*
+ * Read the reply concluding the transfer, the session itself stays
+ * open for the next URL and is only ended at exit.
+ *
+ * If the data connection is still open here, segment processes read
+ * the file and the first one stopped at the end of its range. Closing
+ * the connection makes the server give up on the rest, so that the
+ * reply may well be a 426.
+ */
 void
 ftp_quit(struct url *url)
 {
 	char	*buf = NULL;
 	size_t	 n = 0;
+	int	 code, segmented = 0;
+
+	if (ctrl == NULL)
+		return;
 
-	if (ftp_getline(&buf, &n, 0, ctrl_fp) != P_OK)
+	if (data_fd != -1) {
+		close(data_fd);
+		data_fd = -1;
+		segmented = 1;
+	}
+
+	code = ftp_getline(&buf, &n, 0, ctrl);
+	if (code != P_OK && !segmented)
 		errx(1, "error retrieving file %s", url->fname);
 
 	free(buf);
-	ftp_command(ctrl_fp, "QUIT");
-	fclose(ctrl_fp);
+}
+
+/*
+ * Make the open control connection current for url if it leads to the
+ * same server and is still alive. Anything readable on an idle session
+ * is either EOF or a 421 timeout notice, so such a session is dropped
+ * and a new one logged in.
+ */
+static int
+ftp_reuse(struct url *url)
+{
+	struct pollfd	 pfd;
+	char		*key;
+	int		 same;
+
+	if (ctrl == NULL)
+		return 0;
+
+	xasprintf(&key, "%s:%s", url->host, url->port);
+	same = strcmp(key, ctrl_key) == 0;
+	free(key);
+	pfd.fd = ctrl->fd;
+	pfd.events = POLLIN;
+	if (same && ctrl->len == 0 && poll(&pfd, 1, 0) == 0) {
+		log_info("Reusing connection to %s\n", url->host);
+		return 1;
+	}
+
+	if (!same)
+		ftp_disconnect();
+	else {
+		iobuf_free(ctrl);
+		ctrl = NULL;
+	}
+
+	return 0;
+}
+
+/*
+ * End the session without waiting for the reply, this also runs from
+ * exit paths where the connection may be unusable.
+ */
+static void
+ftp_disconnect(void)
+{
+	if (ctrl == NULL || ctrl_pid != getpid())
+		return;
+
+	if (io_debug)
+		fprintf(stderr, ">>> QUIT\n");
+
+	(void)iobuf_write(ctrl, "QUIT\r\n", 6);
+	iobuf_free(ctrl);
+	ctrl = NULL;
 }
 
 int
-ftp_getline(char **lineptr, size_t *n, int suppress_output, FILE *fp)
+ftp_getline(char **lineptr, size_t *n, int suppress_output, struct iobuf *io)
 {
 	ssize_t		 len;
 	char		*bufp, code[4];
@@ -170,8 +417,8 @@ ftp_getline(char **lineptr, size_t *n, int suppress_output, FILE *fp)
 	int		 lookup[] = { P_PRE, P_OK, P_INTER, N_TRANS, N_PERM };
 
 
-	if ((len = getline(lineptr, n, fp)) == -1)
-		err(1, "%s: getline", __func__);
+	if ((len = iobuf_getline(io, lineptr, n)) == -1)
+		errx(1, "%s: connection closed", __func__);
 
 	bufp = *lineptr;
 	if (!suppress_output)
@@ -186,8 +433,8 @@ ftp_getline(char **lineptr, size_t *n, int suppress_output, FILE *fp)
 
 	/* multi-line reply */
 	while (!(strncmp(code, bufp, 3) == 0 && bufp[3] == ' ')) {
-		if ((len = getline(lineptr, n, fp)) == -1)
-			err(1, "%s: getline", __func__);
+		if ((len = iobuf_getline(io, lineptr, n)) == -1)
+			errx(1, "%s: connection closed", __func__);
 
 		bufp = *lineptr;
 		if (!suppress_output)
@@ -206,7 +453,7 @@ ftp_getline(char **lineptr, size_t *n, int suppress_output, FILE *fp)
 }
 
 int
-ftp_command(FILE *fp, const char *fmt, ...)
+ftp_command(struct iobuf *io, const char *fmt, ...)
 {
 	va_list	 ap;
 	char	*buf = NULL, *cmd;
@@ -219,27 +466,21 @@ ftp_command(FILE *fp, const char *fmt, ...)
 	if (r < 0)
 		errx(1, "%s: vasprintf", __func__);
 
-	if (io_debug)
-		fprintf(stderr, ">>> %s\n", cmd);
-
-	if (fprintf(fp, "%s\r\n", cmd) < 0)
-		errx(1, "%s: fprintf", __func__);
-
-	(void)fflush(fp);
+	ftp_send(io, cmd);
 	free(cmd);
-	r = ftp_getline(&buf, &n, 0, fp);
+	r = ftp_getline(&buf, &n, 0, io);
 	free(buf);
 	return r;
 
 }
 
 int
-ftp_auth(FILE *fp, const char *user, const char *pass)
+ftp_auth(struct iobuf *io, const char *user, const char *pass)
 {
 	char	*addr = NULL, hn[HOST_NAME_MAX+1], *un;
 	int	 code;
 
-	code = ftp_command(fp, "USER %s", user ? user : "anonymous");
+	code = ftp_command(io, "USER %s", user ? user : "anonymous");
 	if (code != P_OK && code != P_INTER)
 		return code;
 
@@ -251,26 +492,23 @@ ftp_auth(FILE *fp, const char *user, const char *pass)
 		xasprintf(&addr, "%s@%s", un ? un : "anonymous", hn);
 	}
 
-	code = ftp_command(fp, "PASS %s", pass ? pass : addr);
+	code = ftp_command(io, "PASS %s", pass ? pass : addr);
 	free(addr);
 	return code;
 }
 
 int
-ftp_size(FILE *fp, const char *fn, off_t *sizep, char **buf)
+ftp_size(struct iobuf *io, const char *fn, off_t *sizep, char **buf)
 {
+	char	*cmd;
 	size_t	 n = 0;
 	off_t	 file_sz;
 	int	 code;
 
-	if (io_debug)
-		fprintf(stderr, ">>> SIZE %s\n", fn);
-
-	if (fprintf(fp, "SIZE %s\r\n", fn) < 0)
-		errx(1, "%s: fprintf", __func__);
-
-	(void)fflush(fp);
-	if ((code = ftp_getline(buf, &n, 1, fp)) != P_OK)
+	xasprintf(&cmd, "SIZE %s", fn);
+	ftp_send(io, cmd);
+	free(cmd);
+	if ((code = ftp_getline(buf, &n, 1, io)) != P_OK)
 		return code;
 
 	if (sscanf(*buf, "%*u %lld", &file_sz) != 1)
@@ -282,8 +520,185 @@ ftp_size(FILE *fp, const char *fn, off_t *sizep, char **buf)
 	return code;
 }
 
+/*
+ * Get the current directory out of the PWD reply, 257 "dir" with any
+ * quotes within dir doubled.
+ */
+int
+ftp_pwd(struct iobuf *io, char **dirp)
+{
+	char	*buf = NULL, *dir, *s;
+	size_t	 i, n = 0;
+	int	 code;
+
+	ftp_send(io, "PWD");
+	if ((code = ftp_getline(&buf, &n, 1, io)) != P_OK) {
+		free(buf);
+		return code;
+	}
+
+	if ((s = strchr(buf, '"')) == NULL) {
+		warnx("Malformed PWD reply");
+		free(buf);
+		return -1;
+	}
+
+	dir = xmalloc(strlen(s));
+	for (i = 0, s++; *s != '\0'; s++) {
+		if (*s == '"' && *++s != '"')
+			break;
+
+		dir[i++] = *s;
+	}
+	dir[i] = '\0';
+	free(buf);
+	*dirp = dir;
+	return code;
+}
+
+int
+ftp_mdtm(struct iobuf *io, const char *fn, time_t *mtimep)
+{
+	char	*buf = NULL, *cmd;
+	size_t	 n = 0;
+	int	 code;
+
+	xasprintf(&cmd, "MDTM %s", fn);
+	ftp_send(io, cmd);
+	free(cmd);
+	if ((code = ftp_getline(&buf, &n, 1, io)) == P_OK)
+		*mtimep = time_parse(buf + 4);
+
+	free(buf);
+	return code;
+}
+
+/*
+ * Ask for the features of the server, returns a FEAT_* mask, 0 when
+ * FEAT isn't understood.
+ */
 int
-ftp_eprt(FILE *fp)
+ftp_feat(struct iobuf *io)
+{
+	ftp_send(io, "FEAT");
+	return feat_reply(io);
+}
+
+/*
+ * Whether to use MODE Z with a server offering feats, -1 if it is
+ * required but not offered.
+ */
+int
+ftp_modez(int feats)
+{
+	switch (modez) {
+	case MODEZ_OFF:
+		return 0;
+	case MODEZ_ON:
+		return (feats & FEAT_MODEZ) ? 1 : -1;
+	default:
+		return (feats & FEAT_MODEZ) != 0;
+	}
+}
+
+int
+modez_lookup(const char *str)
+{
+	if (strcmp(str, "auto") == 0)
+		return MODEZ_AUTO;
+	if (strcmp(str, "off") == 0)
+		return MODEZ_OFF;
+	if (strcmp(str, "on") == 0)
+		return MODEZ_ON;
+
+	return -1;
+}
+
+/*
+ * Parse an MLSD line without its CRLF, "fact=value;...; name", into
+ * ent which points into line. Returns -1 if the line is malformed.
+ */
+int
+ftp_parse_mlsd(char *line, struct ftp_entry *ent)
+{
+	const char	*errstr;
+	char		*fact, *facts, *value;
+
+	ent->size = ent->mtime = -1;
+	ent->type = FT_OTHER;
+	if ((ent->name = strchr(line, ' ')) == NULL)
+		return -1;
+
+	*ent->name++ = '\0';
+	facts = line;
+	while ((fact = strsep(&facts, ";")) != NULL) {
+		if ((value = strchr(fact, '=')) == NULL)
+			continue;
+
+		*value++ = '\0';
+		if (strcasecmp(fact, "type") == 0) {
+			if (strcasecmp(value, "file") == 0)
+				ent->type = FT_FILE;
+			else if (strcasecmp(value, "dir") == 0)
+				ent->type = FT_DIR;
+		} else if (strcasecmp(fact, "size") == 0) {
+			ent->size = strtonum(value, 0, LLONG_MAX, &errstr);
+			if (errstr)
+				return -1;
+		} else if (strcasecmp(fact, "modify") == 0)
+			ent->mtime = time_parse(value);
+	}
+
+	return 0;
+}
+
+/*
+ * Parse a line of a Unix style LIST, the eight fields of ls -l and the
+ * name. The time in there is too coarse to go by and is left out.
+ * Returns -1 for lines that aren't entries, such as "total".
+ */
+int
+ftp_parse_list(char *line, struct ftp_entry *ent)
+{
+	const char	*errstr;
+	char		*fields[8], *p = line;
+	int		 i;
+
+	for (i = 0; i < 8; i++) {
+		p += strspn(p, " \t");
+		fields[i] = p;
+		if ((p = strpbrk(p, " \t")) == NULL)
+			return -1;
+
+		*p++ = '\0';
+	}
+
+	p += strspn(p, " \t");
+	if (*p == '\0')
+		return -1;
+
+	ent->name = p;
+	ent->mtime = -1;
+	ent->size = strtonum(fields[4], 0, LLONG_MAX, &errstr);
+	if (errstr)
+		return -1;
+
+	switch (fields[0][0]) {
+	case '-':
+		ent->type = FT_FILE;
+		break;
+	case 'd':
+		ent->type = FT_DIR;
+		break;
+	default:
+		ent->type = FT_OTHER;
+	}
+
+	return 0;
+}
+
+int
+ftp_eprt(struct iobuf *io)
 {
 	struct sockaddr_storage	 ss;
 	char			 addr[NI_MAXHOST], port[NI_MAXSERV], *eprt;
@@ -292,7 +707,7 @@ ftp_eprt(FILE *fp)
 
 	len = sizeof(ss);
 	memset(&ss, 0, len);
-	if (getsockname(fileno(fp), (struct sockaddr *)&ss, &len) == -1) {
+	if (getsockname(io->fd, (struct sockaddr *)&ss, &len) == -1) {
 		warn("%s: getsockname", __func__);
 		return -1;
 	}
@@ -361,7 +776,7 @@ ftp_eprt(FILE *fp)
 	xasprintf(&eprt, "EPRT |%d|%s|%s|",
 	    ss.ss_family == AF_INET ? 1 : 2, addr, port);
 
-	ret = ftp_command(fp, "%s", eprt);
+	ret = ftp_command(io, "%s", eprt);
 	free(eprt);
 	if (ret != P_OK) {
 		close(sock);
@@ -372,29 +787,47 @@ ftp_eprt(FILE *fp)
 }
 
 int
-ftp_epsv(FILE *fp)
+ftp_epsv(struct iobuf *io)
 {
-	struct sockaddr_storage	 ss;
-	char			*buf = NULL, delim[4], *s, *e;
-	size_t			 n = 0;
-	socklen_t		 len;
-	int			 error, port, sock;
-
-	if (io_debug)
-		fprintf(stderr, ">>> EPSV\n");
+	ftp_send(io, "EPSV");
+	return ftp_epsv_reply(io);
+}
 
-	if (fprintf(fp, "EPSV\r\n") < 0)
-		errx(1, "%s: fprintf", __func__);
+/*
+ * Read the reply to an EPSV sent earlier, possibly ahead of other
+ * commands, and connect to the port it announces.
+ */
+int
+ftp_epsv_reply(struct iobuf *io)
+{
+	char	*buf = NULL;
+	size_t	 n = 0;
+	int	 sock;
 
-	(void)fflush(fp);
-	if (ftp_getline(&buf, &n, 1, fp) != P_OK) {
+	if (ftp_getline(&buf, &n, 1, io) != P_OK) {
 		free(buf);
 		return -1;
 	}
 
+	sock = epsv_connect(io, buf);
+	free(buf);
+	return sock;
+}
+
+/*
+ * Connect to the port announced in the EPSV reply buf, which is
+ * modified.
+ */
+static int
+epsv_connect(struct iobuf *io, char *buf)
+{
+	struct sockaddr_storage	 ss;
+	char			 delim[4], *s, *e;
+	socklen_t		 len;
+	int			 error, port, sock;
+
 	if ((s = strchr(buf, '(')) == NULL || (e = strchr(s, ')')) == NULL) {
 		warnx("Malformed EPSV reply");
-		free(buf);
 		return -1;
 	}
 
@@ -403,10 +836,8 @@ ftp_epsv(FILE *fp)
 	if (sscanf(s, "%c%c%c%d%c", &delim[0], &delim[1], &delim[2],
 	    &port, &delim[3]) != 5) {
 		warnx("EPSV parse error");
-		free(buf);
 		return -1;
 	}
-	free(buf);
 
 	if (delim[0] != delim[1] || delim[0] != delim[2]
 	    || delim[0] != delim[3]) {
@@ -416,7 +847,7 @@ ftp_epsv(FILE *fp)
 
 	len = sizeof(ss);
 	memset(&ss, 0, len);
-	if (getpeername(fileno(fp), (struct sockaddr *)&ss, &len) == -1) {
+	if (getpeername(io->fd, (struct sockaddr *)&ss, &len) == -1) {
 		warn("%s: getpeername", __func__);
 		return -1;
 	}
@@ -448,3 +879,112 @@ ftp_epsv(FILE *fp)
 
 	return sock;
 }
+
+/*
+ * Send a command line, the CRLF is appended here so that the command
+ * goes out in a single write. The reply is left to the caller.
+ */
+void
+ftp_send(struct iobuf *io, const char *cmd)
+{
+	ftp_sendv(io, (char **)&cmd, 1);
+}
+
+/*
+ * Send ncmds command lines in a single write, their replies are read
+ * back in the same order.
+ */
+static void
+ftp_sendv(struct iobuf *io, char **cmds, int ncmds)
+{
+	char	*line = NULL;
+	size_t	 len = 0, n;
+	int	 i;
+
+	for (i = 0; i < ncmds; i++) {
+		if (io_debug)
+			fprintf(stderr, ">>> %s\n", cmds[i]);
+
+		n = strlen(cmds[i]);
+		line = xreallocarray(line, 1, len + n + 2);
+		memcpy(line + len, cmds[i], n);
+		memcpy(line + len + n, "\r\n", 2);
+		len += n + 2;
+	}
+
+	if (iobuf_write(io, line, len) == -1)
+		exit(1);
+
+	free(line);
+}
+
+/*
+ * Read a FEAT reply, "211-" followed by one feature per line indented
+ * by a space and a closing "211 " line. Any other reply, single or
+ * multi-line, means no features.
+ */
+static int
+feat_reply(struct iobuf *io)
+{
+	char	*buf = NULL, *p, code[4];
+	size_t	 n = 0;
+	ssize_t	 len;
+	int	 feats = 0;
+
+	code[0] = '\0';
+	for (;;) {
+		if ((len = iobuf_getline(io, &buf, &n)) == -1)
+			errx(1, "%s: connection closed", __func__);
+
+		if (code[0] == '\0')
+			(void)strlcpy(code, buf, sizeof code);
+		else if (buf[0] == ' ') {
+			p = buf + strspn(buf, " ");
+			p[strcspn(p, "\r\n")] = '\0';
+			if (strcasecmp(p, "MODE Z") == 0)
+				feats |= FEAT_MODEZ;
+		}
+
+		if (len > 3 && strncmp(buf, code, 3) == 0 && buf[3] == ' ')
+			break;
+	}
+
+	free(buf);
+	return strcmp(code, "211") == 0 ? feats : 0;
+}
+
+/*
+ * Convert the UTC time stamp YYYYMMDDHHMMSS[.sss] used by MDTM and
+ * MLSD, returns -1 if it is malformed.
+ */
+static time_t
+time_parse(const char *s)
+{
+	struct tm	 tm;
+	const char	*end;
+
+	memset(&tm, 0, sizeof tm);
+	if ((end = strptime(s, "%Y%m%d%H%M%S", &tm)) == NULL ||
+	    (*end != '\0' && *end != '.' && *end != '\r'))
+		return -1;
+
+	return timegm(&tm);
+}
+
+/*
+ * Many servers announce the size in the reply opening the transfer:
+ * "150 Opening BINARY mode data connection for f (1234 bytes)."
+ * Returns 0 if it isn't there.
+ */
+static off_t
+size_from_reply(const char *buf)
+{
+	const char	*p;
+	long long	 sz;
+
+	if ((p = strrchr(buf, '(')) == NULL ||
+	    sscanf(p, "(%lld bytes)", &sz) != 1 || sz < 0)
+		return 0;
+
+	return sz;
+}
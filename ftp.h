@@ -27,6 +27,7 @@
 
 #define TMPBUF_LEN	131072
 #define	IMSG_OPEN	1
+#define	IMSG_NEXT	2
 
 #define P_PRE	100
 #define P_OK	200
@@ -34,12 +35,40 @@
 #define N_TRANS	400
 #define	N_PERM	500
 
+#define MODEZ_AUTO	0
+#define MODEZ_OFF	1
+#define MODEZ_ON	2
+
+#define FEAT_MODEZ	0x01
+
+#define FT_OTHER	0
+#define FT_FILE		1
+#define FT_DIR		2
+
 #ifndef nitems
 #define nitems(_a)	(sizeof((_a)) / sizeof((_a)[0]))
 #endif
 
 struct imsg;
 struct imsgbuf;
+struct tls;
+
+struct iobuf {
+	struct tls	*tls;
+	char		*buf;
+	size_t		 size;
+	size_t		 off;	/* start of unread data */
+	size_t		 len;	/* amount of unread data */
+	int		 fd;
+};
+
+/* remote directory entry, from MLSD or LIST */
+struct ftp_entry {
+	char	*name;
+	off_t	 size;		/* -1 if unknown */
+	time_t	 mtime;		/* -1 if unknown */
+	int	 type;
+};
 
 struct url {
 	int	 scheme;
@@ -50,7 +79,13 @@ struct url {
 	char	*basic_auth;
 
 	char	*fname;
+	char	*etag;		/* validators, sent and as received */
+	char	*last_modified;
+	off_t	 content_length;
 	int	 chunked;
+	int	 encoded;	/* body is decoded, sizes are wire bytes */
+	int	 not_modified;
+	int	 ranges;
 };
 
 /* cmd.c */
@@ -59,7 +94,9 @@ void	cmd(const char *, const char *, const char *);
 /* main.c */
 extern struct imsgbuf	 child_ibuf;
 extern const char	*useragent;
-extern int		 activemode, family, io_debug, verbose, progressmeter;
+extern int		 activemode, compressed, family, io_debug, verbose;
+extern int		 modez, progressmeter;
+extern int		 connect_delay, dns_ttl, segments;
 extern volatile sig_atomic_t interrupted;
 
 /* file.c */
@@ -68,28 +105,56 @@ void		 file_save(struct url *, FILE *, off_t *);
 
 /* ftp.c */
 void		 ftp_connect(struct url *, struct url *, int);
-struct url	*ftp_get(struct url *, struct url *, off_t *, off_t *);
+struct url	*ftp_get(struct url *, struct url *, int, off_t *, off_t *);
 void		 ftp_quit(struct url *);
 void		 ftp_save(struct url *, FILE *, off_t *);
-int		 ftp_auth(FILE *, const char *, const char *);
-int		 ftp_command(FILE *, const char *, ...)
+void		 ftp_save_range(struct url *, int, off_t, off_t, FILE *,
+		    off_t *);
+void		 ftp_send(struct iobuf *, const char *);
+int		 ftp_auth(struct iobuf *, const char *, const char *);
+int		 ftp_command(struct iobuf *, const char *, ...)
 		     __attribute__((__format__ (printf, 2, 3)))
 		     __attribute__((__nonnull__ (2)));
-int		 ftp_eprt(FILE *);
-int		 ftp_epsv(FILE *);
-int		 ftp_getline(char **, size_t *, int, FILE *);
-int		 ftp_size(FILE *, const char *, off_t *, char **);
+int		 ftp_eprt(struct iobuf *);
+int		 ftp_epsv(struct iobuf *);
+int		 ftp_epsv_reply(struct iobuf *);
+int		 ftp_getline(char **, size_t *, int, struct iobuf *);
+int		 ftp_feat(struct iobuf *);
+int		 ftp_mdtm(struct iobuf *, const char *, time_t *);
+int		 ftp_modez(int);
+int		 modez_lookup(const char *);
+int		 ftp_parse_list(char *, struct ftp_entry *);
+int		 ftp_parse_mlsd(char *, struct ftp_entry *);
+int		 ftp_pwd(struct iobuf *, char **);
+int		 ftp_size(struct iobuf *, const char *, off_t *, char **);
 
 /* http.c */
 void		 http_connect(struct url *, struct url *, int);
-struct url	*http_get(struct url *, struct url *, off_t *, off_t *);
+struct url	*http_get(struct url *, struct url *, int, off_t *, off_t *);
 void		 http_close(struct url *);
+int		 http_pipeline(struct url *, struct url *);
 void		 http_save(struct url *, FILE *, off_t *);
+void		 http_save_range(struct url *, struct url *, int, off_t, off_t,
+		    FILE *, off_t *);
 void		 https_init(char *);
 
 /* progressmeter.c */
+enum {
+	TIMING_START,
+	TIMING_DNS,
+	TIMING_CONNECT,
+	TIMING_TLS,
+	TIMING_FIRSTBYTE,
+	TIMING_END,
+	TIMING_NPHASES
+};
+
+time_t	monotime(void);
 void	start_progress_meter(const char *, const char *, off_t, off_t *);
 void	stop_progress_meter(void);
+void	timing_mark(int);
+void	timing_report(int, const char *, const char *, off_t);
+void	timing_reset(void);
 
 /* url.c */
 int		 scheme_lookup(const char *);
@@ -97,15 +162,25 @@ void		 url_connect(struct url *, struct url *, int);
 char		*url_encode(const char *);
 void		 url_free(struct url *);
 struct url	*url_parse(const char *);
-struct url	*url_request(struct url *, struct url *, off_t *, off_t *);
+int		 url_pipeline(struct url *, struct url *);
+struct url	*url_request(struct url *, struct url *, int, off_t *,
+		    off_t *);
 void		 url_save(struct url *, FILE *, off_t *);
+void		 url_save_range(struct url *, struct url *, int, off_t, off_t,
+		    FILE *, off_t *);
 void		 url_close(struct url *);
 char		*url_str(struct url *);
 void	 	 log_request(const char *, struct url *, struct url *);
 
 /* util.c */
 int	connect_wait(int);
-void	copy_file(FILE *, FILE *, off_t *);
+void	copy_file(FILE *, FILE *, off_t, off_t *);
+void	deflate_file(FILE *, FILE *, off_t *);
+off_t	fd_sendfile(int, int, off_t, off_t *);
+off_t	fd_splice(int, int, off_t, off_t *);
+void	inflate_file(FILE *, FILE *, off_t *);
+void	dns_prefetch(const char *, const char *);
+void	dns_prefetch_run(void);
 int	tcp_connect(const char *, const char *, int);
 int	fd_request(char *, int, off_t *);
 int	read_message(struct imsgbuf *, struct imsg *);
@@ -113,3 +188,10 @@ void	send_message(struct imsgbuf *, int, uint32_t, void *, size_t, int);
 void	log_info(const char *, ...)
 	    __attribute__((__format__ (printf, 1, 2)))
 	    __attribute__((__nonnull__ (1)));
+struct iobuf	*iobuf_new(int);
+void		 iobuf_free(struct iobuf *);
+void		 iobuf_consume(struct iobuf *, size_t);
+ssize_t		 iobuf_fill(struct iobuf *);
+ssize_t		 iobuf_getline(struct iobuf *, char **, size_t *);
+char		*iobuf_peek(struct iobuf *, size_t *);
+int		 iobuf_write(struct iobuf *, const char *, size_t);
@@ -15,16 +15,21 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/queue.h>
+
+#include <ctype.h>
 #include <err.h>
 #include <fcntl.h>
 #include <libgen.h>
 #include <limits.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
+#include <zlib.h>
 #ifndef NOSSL
 #include <tls.h>
 #endif
@@ -33,10 +38,12 @@
 #include "xmalloc.h"
 
 #define MAX_REDIRECTS	10
+#define MAX_IDLE_CONNS	8
+#define MAX_PIPELINE	32
+#define IDLE_TIMEOUT	30
 
 #ifndef NOSSL
 #define	DEFAULT_CA_FILE	"/etc/ssl/cert.pem"
-#define MINBUF		128
 
 static struct tls_config	*tls_config;
 static struct tls		*ctx;
@@ -149,50 +156,123 @@ static struct http_status {
 	{ 0,	NULL },
 	};
 
+enum {
+	H_UNKNOWN,
+	H_ACCEPT_RANGES,
+	H_CONNECTION,
+	H_CONTENT_ENCODING,
+	H_CONTENT_LENGTH,
+	H_CONTENT_RANGE,
+	H_ETAG,
+	H_KEEP_ALIVE,
+	H_LAST_MODIFIED,
+	H_LOCATION,
+	H_RETRY_AFTER,
+	H_TRANSFER_ENCODING,
+};
+
+/*
+ * Parsed response. The header block is copied once behind the struct
+ * and the string fields point into it, NULL if the header was absent.
+ */
 struct http_headers {
 	char	*location;
+	char	*etag;
+	char	*last_modified;
+	char	*content_range;
+	char	*content_encoding;
+	char	*connection;
+	char	*retry_after;
+	char	*accept_ranges;
 	off_t	 content_length;
+	time_t	 keepalive_timeout;
 	int	 chunked;
+	int	 keepalive;
+	char	*raw;
+};
+
+/* Idle persistent connection, keyed on scheme/host/port/proxy */
+struct http_conn {
+	TAILQ_ENTRY(http_conn)	 entry;
+	char			*key;
+	struct iobuf		*io;
+#ifndef NOSSL
+	struct tls		*ctx;
+#endif
+	time_t			 expire;
 };
 
-static void		 decode_chunk(int, uint, FILE *);
-static char		*header_lookup(const char *, const char *);
+static char		*conn_key_get(struct url *, struct url *);
+static struct http_conn	*conn_detach(void);
+static void		 conn_free(struct http_conn *);
+static int		 conn_reuse(const char *);
+static int		 header_id(const char *, size_t);
+static size_t		 headers_read(void);
 static const char	*http_error(int);
 static void		 http_headers_free(struct http_headers *);
-static ssize_t		 http_getline(int, char **, size_t *);
-static size_t		 http_read(int, char *, size_t);
+static void		 keepalive_parse(char *, struct http_headers *);
+static void		 body_write(FILE *, const char *, size_t);
+static void		 http_body_init(struct url *, struct http_headers *);
+static void		 http_copy(struct url *, FILE *, off_t *);
+static char		*http_prepare(struct url *, struct url *, const char *);
 static struct url	*http_redirect(struct url *, char *);
 static void		 http_save_chunks(struct url *, FILE *, off_t *);
 static int		 http_status_cmp(const void *, const void *);
-static int		 http_request(int, const char *,
-			    struct http_headers **);
+static int		 http_request(const char *, struct http_headers **);
+static int		 http_response(struct http_headers **);
+static void		 pending_clear(void);
 static char		*relative_path_resolve(const char *, const char *);
 
-#ifndef NOSSL
-static void		 tls_copy_file(struct url *, FILE *, off_t *);
-static ssize_t		 tls_getline(char **, size_t *, struct tls *);
-#endif
-
-static FILE	*fp;
+static TAILQ_HEAD(, http_conn)	 idle_conns =
+				    TAILQ_HEAD_INITIALIZER(idle_conns);
+static struct iobuf		*io;
+static char			*conn_key;
+static time_t			 conn_timeout;
+static size_t			 nidle_conns;
+static off_t			 body_left;
+static char			*pending[MAX_PIPELINE];
+static int			 conn_reused, keepalive, npending;
+static int			 pipeline_failed;
+static z_stream			 zs;
+static char			*zbuf;
+static int			 inflating, inflated;
 
 void
 http_connect(struct url *url, struct url *proxy, int timeout)
 {
 	const char	*host, *port;
+	char		*key;
 	int		 sock;
 
+	/* the connection was kept for the responses to pipelined requests */
+	key = conn_key_get(url, proxy);
+	if (npending > 0) {
+		if (strcmp(key, conn_key) == 0) {
+			free(key);
+			conn_reused = 1;
+			return;
+		}
+
+		pending_clear();
+		conn_free(conn_detach());
+	}
+
+	free(conn_key);
+	conn_key = key;
+	if ((conn_reused = conn_reuse(conn_key)) == 1)
+		return;
+
 	host = proxy ? proxy->host : url->host;
 	port = proxy ? proxy->port : url->port;
 	if ((sock = tcp_connect(host, port, timeout)) == -1)
 		exit(1);
 
-	if ((fp = fdopen(sock, "r+")) == NULL)
-		err(1, "%s: fdopen", __func__);
+	io = iobuf_new(sock);
 
 #ifndef NOSSL
 	struct http_headers	*headers;
 	char			*auth = NULL, *req;
-	int			 authlen, code;
+	int			 authlen, code, r;
 
 	if (url->scheme != S_HTTPS)
 		return;
@@ -213,7 +293,7 @@ http_connect(struct url *url, struct url *proxy, int timeout)
 		    url->basic_auth ? auth : "");
 
 		freezero(auth, authlen);
-		if ((code = http_request(S_HTTP, req, &headers)) != 200)
+		if ((code = http_request(req, &headers)) != 200)
 			errx(1, "%s: failed to CONNECT to %s:%s: %s",
 			    __func__, url->host, url->port, http_error(code));
 
@@ -229,48 +309,69 @@ http_connect(struct url *url, struct url *proxy, int timeout)
 
 	if (tls_connect_socket(ctx, sock, url->host) != 0)
 		errx(1, "%s: %s", __func__, tls_error(ctx));
+
+	/* handshake now rather than on first use to time it */
+	do {
+		r = tls_handshake(ctx);
+	} while (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT);
+	if (r == -1)
+		errx(1, "%s: %s", __func__, tls_error(ctx));
+
+	timing_mark(TIMING_TLS);
+	io->tls = ctx;
 #endif /* NOSSL */
 }
 
 struct url *
-http_get(struct url *url, struct url *proxy, off_t *offset, off_t *sz)
+http_get(struct url *url, struct url *proxy, int timeout, off_t *offset,
+    off_t *sz)
 {
 	struct http_headers	*headers;
-	char			*auth = NULL, *path = NULL, *range = NULL, *req;
-	int			 authlen, code, redirects = 0;
+	char			*range = NULL, *req;
+	off_t			 discard = 0;
+	int			 code, redirects = 0;
 
  redirected:
 	log_request("Requesting", url, proxy);
-	if (*offset)
+	/* a range request also probes for range support when segmenting */
+	if (*offset || segments > 1)
 		xasprintf(&range, "Range: bytes=%lld-\r\n", *offset);
 
-	if (url->basic_auth)
-		authlen = xasprintf(&auth, "Authorization: Basic %s\r\n",
-		    url->basic_auth);
-
-	if (proxy && url->scheme != S_HTTPS)
-		path = url_str(url);
-	else if (url->path)
-		path = url_encode(url->path);
-
-	xasprintf(&req,
-	    "GET %s HTTP/1.1\r\n"
-	    "Host: %s\r\n"
-	    "%s"
-	    "%s"
-	    "Connection: close\r\n"
-	    "User-Agent: %s\r\n"
-	    "\r\n",
-	    path ? path : "/",
-	    url->host,
-	    *offset ? range : "",
-	    url->basic_auth ? auth : "",
-	    useragent);
-	code = http_request(url->scheme, req, &headers);
-	freezero(auth, authlen);
+	req = http_prepare(url, proxy, range);
+	if (npending > 0 && strcmp(pending[0], req) == 0) {
+		/* the request was pipelined, its response comes next */
+		free(pending[0]);
+		memmove(pending, pending + 1, --npending * sizeof(*pending));
+		code = http_response(&headers);
+	} else {
+		/* a request out of turn would get the wrong response */
+		if (npending > 0) {
+			pending_clear();
+			keepalive = 0;
+			http_close(url);
+			http_connect(url, proxy, timeout);
+		}
+		code = http_request(req, &headers);
+	}
+	if (code == -1 && conn_reused) {
+		/* server dropped the idle connection, retry on a fresh one */
+		keepalive = 0;
+		http_close(url);
+		http_connect(url, proxy, timeout);
+		code = http_request(req, &headers);
+	}
 	free(range);
-	free(path);
 	free(req);
+	range = NULL;
+	if (code == -1)
+		errx(1, "%s: connection closed by server", __func__);
+
+	/* not in headers_read(), a proxy's CONNECT reply doesn't count */
+	timing_mark(TIMING_FIRSTBYTE);
+	http_body_init(url, headers);
+	/* ftp:// through a proxy can't be re-requested as is, see ftp_get() */
+	url->ranges = code == 206 && headers->content_length != -1 &&
+	    url->scheme != S_FTP;
 	switch (code) {
 	case 200:
 		if (*offset) {
@@ -280,10 +381,18 @@ http_get(struct url *url, struct url *proxy, off_t *offset, off_t *sz)
 		break;
 	case 206:
 		break;
+	case 304:
+		/* the local copy is current */
+		url->not_modified = 1;
+		http_headers_free(headers);
+		return url;
 	case 301:
 	case 302:
 	case 303:
 	case 307:
+		/* drain the body so that the connection can be reused */
+		if (keepalive)
+			http_save(url, NULL, &discard);
 		http_close(url);
 		if (++redirects > MAX_REDIRECTS)
 			errx(1, "Too many redirections requested");
@@ -294,7 +403,7 @@ http_get(struct url *url, struct url *proxy, off_t *offset, off_t *sz)
 		url = http_redirect(url, headers->location);
 		http_headers_free(headers);
 		log_request("Redirected to", url, proxy);
-		http_connect(url, proxy, 0);
+		http_connect(url, proxy, timeout);
 		goto redirected;
 	case 416:
 		errx(1, "File is already fully retrieved.");
@@ -303,23 +412,258 @@ http_get(struct url *url, struct url *proxy, off_t *offset, off_t *sz)
 		errx(1, "Error retrieving file: %d %s", code, http_error(code));
 	}
 
-	*sz = headers->content_length + *offset;
-	url->chunked = headers->chunked;
+	if (headers->content_length != -1)
+		*sz = headers->content_length + *offset;
+
+	free(url->etag);
+	free(url->last_modified);
+	url->etag = headers->etag ? xstrdup(headers->etag) : NULL;
+	url->last_modified = headers->last_modified ?
+	    xstrdup(headers->last_modified) : NULL;
+
 	http_headers_free(headers);
 	return url;
 }
 
+/*
+ * Fetch len bytes of url starting at start over a connection of its own.
+ * Used by segmented downloads after http_get() found ranges supported.
+ */
+void
+http_save_range(struct url *url, struct url *proxy, int timeout, off_t start,
+    off_t len, FILE *dst_fp, off_t *offset)
+{
+	struct http_headers	*headers;
+	char			*range, *req;
+	int			 code;
+
+	http_connect(url, proxy, timeout);
+	xasprintf(&range, "Range: bytes=%lld-%lld\r\n", (long long)start,
+	    (long long)(start + len - 1));
+	req = http_prepare(url, proxy, range);
+	code = http_request(req, &headers);
+	free(range);
+	free(req);
+	if (code != 206)
+		errx(1, "%s: range %lld-%lld not served: %d %s", __func__,
+		    (long long)start, (long long)(start + len - 1), code,
+		    http_error(code));
+
+	if (headers->content_length != -1 && headers->content_length != len)
+		errx(1, "%s: range %lld-%lld has unexpected length %lld",
+		    __func__, (long long)start, (long long)(start + len - 1),
+		    (long long)headers->content_length);
+
+	http_body_init(url, headers);
+	http_headers_free(headers);
+	http_save(url, dst_fp, offset);
+	http_close(url);
+}
+
+static char *
+http_prepare(struct url *url, struct url *proxy, const char *range)
+{
+	char	*auth = NULL, *cond = NULL, *path = NULL, *req;
+	int	 authlen;
+
+	if (url->basic_auth)
+		authlen = xasprintf(&auth, "Authorization: Basic %s\r\n",
+		    url->basic_auth);
+
+	if (url->etag || url->last_modified)
+		xasprintf(&cond, "%s%s%s%s%s%s",
+		    url->etag ? "If-None-Match: " : "",
+		    url->etag ? url->etag : "",
+		    url->etag ? "\r\n" : "",
+		    url->last_modified ? "If-Modified-Since: " : "",
+		    url->last_modified ? url->last_modified : "",
+		    url->last_modified ? "\r\n" : "");
+
+	if (proxy && url->scheme != S_HTTPS)
+		path = url_str(url);
+	else if (url->path)
+		path = url_encode(url->path);
+
+	/* a range of the encoded body can't be appended to a decoded file */
+	xasprintf(&req,
+	    "GET %s HTTP/1.1\r\n"
+	    "Host: %s\r\n"
+	    "%s"
+	    "%s"
+	    "%s"
+	    "%s"
+	    "User-Agent: %s\r\n"
+	    "\r\n",
+	    path ? path : "/",
+	    url->host,
+	    range ? range : "",
+	    cond ? cond : "",
+	    compressed && range == NULL ?
+	    "Accept-Encoding: gzip, deflate\r\n" : "",
+	    url->basic_auth ? auth : "",
+	    useragent);
+
+	freezero(auth, authlen);
+	free(cond);
+	free(path);
+	return req;
+}
+
+/*
+ * Set up body framing and connection persistence for a response.
+ */
+static void
+http_body_init(struct url *url, struct http_headers *headers)
+{
+	/* a redirect body that was never drained left its stream set up */
+	if (inflating) {
+		inflating = 0;
+		inflateEnd(&zs);
+	}
+
+	keepalive = headers->keepalive &&
+	    (headers->chunked || headers->content_length != -1);
+	conn_timeout = headers->keepalive_timeout;
+	body_left = headers->chunked ? -1 : headers->content_length;
+	url->chunked = headers->chunked;
+	url->content_length = headers->content_length;
+	url->encoded = 0;
+
+	/* only whole bodies are decoded, see http_prepare() */
+	if (!compressed || headers->content_encoding == NULL ||
+	    headers->content_range != NULL)
+		return;
+
+	if (strcasecmp(headers->content_encoding, "gzip") != 0 &&
+	    strcasecmp(headers->content_encoding, "x-gzip") != 0 &&
+	    strcasecmp(headers->content_encoding, "deflate") != 0)
+		return;
+
+	if (zbuf == NULL)
+		zbuf = xmalloc(TMPBUF_LEN);
+
+	/* window bits + 32 detects both the gzip and zlib headers */
+	memset(&zs, 0, sizeof zs);
+	if (inflateInit2(&zs, MAX_WBITS + 32) != Z_OK)
+		errx(1, "%s: inflateInit2: %s", __func__,
+		    zs.msg ? zs.msg : "failed");
+
+	url->encoded = 1;
+	inflating = 1;
+	inflated = 0;
+}
+
+/*
+ * Hand a run of body bytes to dst_fp, inflating it first if the body
+ * is being decoded. A NULL dst_fp discards it.
+ */
+static void
+body_write(FILE *dst_fp, const char *buf, size_t len)
+{
+	size_t	n;
+	int	r;
+
+	if (dst_fp == NULL)
+		return;
+
+	if (!inflating) {
+		if (fwrite(buf, 1, len, dst_fp) != len)
+			err(1, "%s: fwrite", __func__);
+		return;
+	}
+
+	zs.next_in = (Bytef *)buf;
+	zs.avail_in = len;
+	do {
+		/* anything following the end of the stream is ignored */
+		if (inflated)
+			return;
+
+		zs.next_out = (Bytef *)zbuf;
+		zs.avail_out = TMPBUF_LEN;
+		r = inflate(&zs, Z_NO_FLUSH);
+		if (r == Z_STREAM_END)
+			inflated = 1;
+		else if (r != Z_OK && r != Z_BUF_ERROR)
+			errx(1, "%s: inflate: %s", __func__,
+			    zs.msg ? zs.msg : "invalid data");
+
+		n = TMPBUF_LEN - zs.avail_out;
+		if (fwrite(zbuf, 1, n, dst_fp) != n)
+			err(1, "%s: fwrite", __func__);
+	} while (r != Z_BUF_ERROR && (zs.avail_in > 0 || zs.avail_out == 0));
+}
+
 void
 http_save(struct url *url, FILE *dst_fp, off_t *offset)
 {
 	if (url->chunked)
 		http_save_chunks(url, dst_fp, offset);
-#ifndef NOSSL
-	else if (url->scheme == S_HTTPS)
-		tls_copy_file(url, dst_fp, offset);
-#endif
 	else
-		copy_file(dst_fp, fp, offset);
+		http_copy(url, dst_fp, offset);
+
+	if (!inflating)
+		return;
+
+	inflating = 0;
+	inflateEnd(&zs);
+	if (dst_fp && !inflated && !interrupted)
+		errx(1, "%s: compressed body truncated", __func__);
+}
+
+/*
+ * Copy the body to dst_fp, a NULL dst_fp discards it. The body is
+ * delimited by Content-Length if known, by the connection close otherwise.
+ * Data is written straight out of the connection buffer, and once that
+ * is drained a plaintext body is spliced from the socket if possible.
+ */
+static void
+http_copy(struct url *url, FILE *dst_fp, off_t *offset)
+{
+	char	*buf;
+	off_t	 left, n;
+	size_t	 r;
+	int	 splice;
+
+	splice = dst_fp != NULL && io->tls == NULL && !inflating;
+	left = url->content_length;
+	while (left != 0 && !interrupted) {
+		if (splice && io->len == 0) {
+			splice = 0;
+			if (fflush(dst_fp) == EOF)
+				err(1, "%s: fflush", __func__);
+
+			n = fd_splice(fileno(dst_fp), io->fd, left, offset);
+			if (n != -1) {
+				if (left > 0)
+					left -= n;
+				if (body_left > 0)
+					body_left -= n;
+				continue;
+			}
+		}
+
+		buf = iobuf_peek(io, &r);
+		if (r == 0 && left > 0)
+			errx(1, "%s: connection closed with %lld bytes of the "
+			    "body missing", __func__, (long long)left);
+
+		if (r == 0)
+			break;
+
+		if (left > 0 && (off_t)r > left)
+			r = left;
+
+		body_write(dst_fp, buf, r);
+
+		iobuf_consume(io, r);
+		if (left > 0)
+			left -= r;
+		if (body_left > 0)
+			body_left -= r;
+
+		*offset += r;
+	}
 }
 
 static struct url *
@@ -350,6 +694,10 @@ http_redirect(struct url *old_url, char *location)
 
  done:
 	new_url->fname = xstrdup(old_url->fname);
+	if (old_url->etag)
+		new_url->etag = xstrdup(old_url->etag);
+	if (old_url->last_modified)
+		new_url->last_modified = xstrdup(old_url->last_modified);
 	url_free(old_url);
 	return new_url;
 }
@@ -378,179 +726,570 @@ relative_path_resolve(const char *base_path, const char *location)
 	return new_path;
 }
 
+/*
+ * Decode a chunked body straight out of the connection buffer. The state
+ * survives buffer refills, so chunk boundaries may fall anywhere and runs
+ * of payload are written out as they are found. Chunk extensions and
+ * trailers are skipped.
+ */
 static void
 http_save_chunks(struct url *url, FILE *dst_fp, off_t *offset)
 {
-	char	*buf = NULL;
-	size_t	 n = 0;
-	uint	 chunk_sz;
-
-	http_getline(url->scheme, &buf, &n);
-	if (sscanf(buf, "%x", &chunk_sz) != 1)
-		errx(1, "%s: Failed to get chunk size", __func__);
-
-	while (chunk_sz > 0) {
-		decode_chunk(url->scheme, chunk_sz, dst_fp);
-		*offset += chunk_sz;
-		http_getline(url->scheme, &buf, &n);
-		if (sscanf(buf, "%x", &chunk_sz) != 1)
-			errx(1, "%s: Failed to get chunk size", __func__);
+	enum {
+		CHUNK_SIZE,
+		CHUNK_EXT,
+		CHUNK_DATA,
+		CHUNK_DATA_CR,
+		CHUNK_DATA_LF,
+		CHUNK_TRAILER,
+		CHUNK_TRAILER_LINE,
+		CHUNK_LAST_LF,
+		CHUNK_DONE,
+	}	 state = CHUNK_SIZE;
+	char	*buf, *end, *p, *q;
+	off_t	 chunk_sz = 0;
+	size_t	 len, n;
+	int	 digits = 0;
+
+	while (state != CHUNK_DONE && !interrupted) {
+		buf = iobuf_peek(io, &len);
+		if (len == 0) {
+			/* tolerate a missing end of trailers */
+			if (state >= CHUNK_TRAILER)
+				break;
+
+			errx(1, "%s: Premature end of chunked body", __func__);
+		}
+
+		p = buf;
+		end = buf + len;
+		while (p < end && state != CHUNK_DONE) {
+			switch (state) {
+			case CHUNK_SIZE:
+				if (isxdigit((unsigned char)*p)) {
+					if (chunk_sz > INT64_MAX >> 4)
+						errx(1, "%s: Chunk size too large",
+						    __func__);
+
+					chunk_sz = chunk_sz << 4 |
+					    (isdigit((unsigned char)*p) ? *p - '0' :
+					    tolower((unsigned char)*p) - 'a' + 10);
+					digits++;
+					p++;
+					break;
+				}
+
+				if (digits == 0)
+					errx(1, "%s: Failed to get chunk size",
+					    __func__);
+
+				state = CHUNK_EXT;
+				/* FALLTHROUGH */
+			case CHUNK_EXT:
+				if ((q = memchr(p, '\n', end - p)) == NULL) {
+					p = end;
+					break;
+				}
+
+				p = q + 1;
+				digits = 0;
+				state = chunk_sz ? CHUNK_DATA : CHUNK_TRAILER;
+				break;
+			case CHUNK_DATA:
+				n = end - p;
+				if ((off_t)n > chunk_sz)
+					n = chunk_sz;
+
+				body_write(dst_fp, p, n);
+
+				p += n;
+				chunk_sz -= n;
+				*offset += n;
+				if (chunk_sz == 0)
+					state = CHUNK_DATA_CR;
+				break;
+			case CHUNK_DATA_CR:
+				state = CHUNK_DATA_LF;
+				if (*p == '\r') {
+					p++;
+					break;
+				}
+				/* FALLTHROUGH */
+			case CHUNK_DATA_LF:
+				if (*p++ != '\n')
+					errx(1, "%s: Invalid chunked encoding",
+					    __func__);
+
+				state = CHUNK_SIZE;
+				break;
+			case CHUNK_TRAILER:
+				if (*p == '\r') {
+					p++;
+					state = CHUNK_LAST_LF;
+					break;
+				}
+
+				if (*p == '\n') {
+					p++;
+					state = CHUNK_DONE;
+					break;
+				}
+
+				state = CHUNK_TRAILER_LINE;
+				/* FALLTHROUGH */
+			case CHUNK_TRAILER_LINE:
+				if ((q = memchr(p, '\n', end - p)) == NULL) {
+					p = end;
+					break;
+				}
+
+				p = q + 1;
+				state = CHUNK_TRAILER;
+				break;
+			case CHUNK_LAST_LF:
+				if (*p++ != '\n')
+					errx(1, "%s: Invalid chunked encoding",
+					    __func__);
+
+				state = CHUNK_DONE;
+				break;
+			case CHUNK_DONE:
+				break;
+			}
+		}
+
+		iobuf_consume(io, p - buf);
 	}
 
-	free(buf);
+	if (state == CHUNK_DONE)
+		body_left = 0;
 }
 
-static void
-decode_chunk(int scheme, uint sz, FILE *dst_fp)
+/*
+ * Park the connection in the idle pool if the response allows it and
+ * its body has been consumed entirely, close it otherwise.
+ */
+void
+http_close(struct url *url)
 {
-	size_t	bufsz;
-	size_t	r;
-	char	buf[BUFSIZ], crlf[2];
+	struct http_conn	*c;
 
-	bufsz = sizeof(buf);
-	while (sz > 0) {
-		if (sz < bufsz)
-			bufsz = sz;
+	if (io == NULL)
+		return;
 
-		r = http_read(scheme, buf, bufsz);
-		if (fwrite(buf, 1, r, dst_fp) != r)
-			errx(1, "%s: fwrite", __func__);
+	/* stay current, responses to pipelined requests are on their way */
+	if (keepalive && body_left == 0 && npending > 0)
+		return;
 
-		sz -= r;
+#ifndef NOSSL
+	if (url->scheme == S_HTTPS && tls_session_fd != -1)
+		dprintf(STDERR_FILENO, "tls session resumed: %s\n",
+		    tls_conn_session_resumed(ctx) ? "yes" : "no");
+#endif
+	c = conn_detach();
+	if (!keepalive || body_left != 0) {
+		/* requests written ahead are lost, stop pipelining */
+		if (npending > 0)
+			pipeline_failed = 1;
+
+		pending_clear();
+		conn_free(c);
+		return;
 	}
 
-	/* CRLF terminating the chunk */
-	if (http_read(scheme, crlf, sizeof(crlf)) != sizeof(crlf))
-		errx(1, "%s: Failed to read terminal crlf", __func__);
+	c->expire = monotime() + (conn_timeout ? conn_timeout : IDLE_TIMEOUT);
+	if (nidle_conns == MAX_IDLE_CONNS) {
+		conn_free(TAILQ_FIRST(&idle_conns));
+		nidle_conns--;
+	}
 
-	if (crlf[0] != '\r' || crlf[1] != '\n')
-		errx(1, "%s: Invalid chunked encoding", __func__);
+	TAILQ_INSERT_TAIL(&idle_conns, c, entry);
+	nidle_conns++;
 }
 
-void
-http_close(struct url *url)
+/*
+ * Write the request for url ahead on the current connection, its
+ * response is read by http_get() in turn. Returns 1 if the request was
+ * sent, 0 if it has to wait for a connection of its own.
+ */
+int
+http_pipeline(struct url *url, struct url *proxy)
 {
-#ifndef NOSSL
-	ssize_t	r;
+	char	*key, *req;
+	int	 same;
 
-	if (url->scheme == S_HTTPS) {
-		if (tls_session_fd != -1)
-			dprintf(STDERR_FILENO, "tls session resumed: %s\n",
-			    tls_conn_session_resumed(ctx) ? "yes" : "no");
+	if (io == NULL || !keepalive || pipeline_failed ||
+	    npending == MAX_PIPELINE)
+		return 0;
 
-		do {
-			r = tls_close(ctx);
-		} while (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT);
-		tls_free(ctx);
+	key = conn_key_get(url, proxy);
+	same = strcmp(key, conn_key) == 0;
+	free(key);
+	if (!same)
+		return 0;
+
+	req = http_prepare(url, proxy, NULL);
+	if (io_debug)
+		fprintf(stderr, "<<< %s", req);
+
+	if (iobuf_write(io, req, strlen(req)) == -1) {
+		free(req);
+		keepalive = 0;
+		return 0;
 	}
 
+	pending[npending++] = req;
+	return 1;
+}
+
+static void
+pending_clear(void)
+{
+	while (npending > 0)
+		free(pending[--npending]);
+}
+
+/*
+ * Move the current connection into a struct http_conn.
+ */
+static struct http_conn *
+conn_detach(void)
+{
+	struct http_conn	*c;
+
+	c = xcalloc(1, sizeof *c);
+	c->key = conn_key;
+	c->io = io;
+	conn_key = NULL;
+	io = NULL;
+#ifndef NOSSL
+	c->ctx = ctx;
+	ctx = NULL;
 #endif
-	fclose(fp);
+	return c;
 }
 
+static char *
+conn_key_get(struct url *url, struct url *proxy)
+{
+	char	*key;
+
+	/* plain requests through a proxy all share the proxy connection */
+	if (proxy && url->scheme != S_HTTPS)
+		xasprintf(&key, "%s:%s", proxy->host, proxy->port);
+	else
+		xasprintf(&key, "%d:%s:%s:%s:%s", url->scheme,
+		    url->host, url->port,
+		    proxy ? proxy->host : "", proxy ? proxy->port : "");
+
+	return key;
+}
+
+/*
+ * Take an idle connection matching key out of the pool and make it
+ * current. Connections past their keep-alive timeout or with pending
+ * input, most likely an EOF from the server, are discarded.
+ */
 static int
-http_request(int scheme, const char *req, struct http_headers **hdrs)
+conn_reuse(const char *key)
 {
-	struct http_headers	*headers;
-	const char		*e;
-	char			*buf = NULL, *p;
-	size_t			 n = 0;
-	ssize_t			 buflen;
-	uint			 code;
+	struct http_conn	*c;
+	struct pollfd		 pfd;
+
+	TAILQ_FOREACH(c, &idle_conns, entry)
+		if (strcmp(c->key, key) == 0)
+			break;
+
+	if (c == NULL)
+		return 0;
+
+	TAILQ_REMOVE(&idle_conns, c, entry);
+	nidle_conns--;
+	pfd.fd = c->io->fd;
+	pfd.events = POLLIN;
+	if (monotime() >= c->expire || c->io->len != 0 ||
+	    poll(&pfd, 1, 0) != 0) {
+		conn_free(c);
+		return 0;
+	}
+
+	io = c->io;
 #ifndef NOSSL
-	ssize_t			 nw;
+	if (c->ctx)
+		ctx = c->ctx;
 #endif
+	free(c->key);
+	free(c);
+	return 1;
+}
 
-	if (io_debug)
-		fprintf(stderr, "<<< %s", req);
-
-	switch (scheme) {
+static void
+conn_free(struct http_conn *c)
+{
 #ifndef NOSSL
-	case S_HTTPS:
+	ssize_t	r;
+
+	if (c->ctx) {
 		do {
-			nw = tls_write(ctx, req, strlen(req));
-		} while (nw == TLS_WANT_POLLIN || nw == TLS_WANT_POLLOUT);
-		if (nw == -1)
-			errx(1, "%s: tls_write: %s", __func__, tls_error(ctx));
-		break;
-#endif
-	case S_FTP:
-	case S_HTTP:
-		if (fprintf(fp, "%s", req) < 0)
-			errx(1, "%s: fprintf", __func__);
-		(void)fflush(fp);
-		break;
+			r = tls_close(c->ctx);
+		} while (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT);
+		tls_free(c->ctx);
 	}
+#endif
+	iobuf_free(c->io);
+	free(c->key);
+	free(c);
+}
 
-	http_getline(scheme, &buf, &n);
+static int
+http_request(const char *req, struct http_headers **hdrs)
+{
 	if (io_debug)
-		fprintf(stderr, ">>> %s", buf);
+		fprintf(stderr, "<<< %s", req);
 
-	if (sscanf(buf, "%*s %u %*s", &code) != 1)
-		errx(1, "%s: failed to extract status code", __func__);
+	/* a failed write is reported like an EOF so it can be retried */
+	if (iobuf_write(io, req, strlen(req)) == -1)
+		return -1;
 
-	if (code < 100 || code > 511)
-		errx(1, "%s: invalid status code %d", __func__, code);
+	return http_response(hdrs);
+}
 
-	headers = xcalloc(1, sizeof *headers);
-	for (;;) {
-		buflen = http_getline(scheme, &buf, &n);
-		buf[buflen - 1] = '\0';
-		buflen -= 1;
-		if (buflen > 0 && buf[buflen - 1] == '\r') {
-			buf[buflen - 1] = '\0';
-			buflen -= 1;
-		}
+/*
+ * Read and parse the response to the oldest outstanding request,
+ * -1 if the connection was closed first.
+ */
+static int
+http_response(struct http_headers **hdrs)
+{
+	struct http_headers	*headers;
+	const char		*e;
+	char			*end, *line, *name, *next, *p;
+	size_t			 len, namelen;
+	uint			 code;
+
+	if ((len = headers_read()) == 0)
+		return -1;
+
+	headers = xcalloc(1, sizeof *headers + len + 1);
+	headers->raw = (char *)(headers + 1);
+	memcpy(headers->raw, io->buf + io->off, len);
+	iobuf_consume(io, len);
+	headers->content_length = -1;
+	end = headers->raw + len;
+	for (line = headers->raw; line < end; line = next) {
+		next = memchr(line, '\n', end - line);
+		*next++ = '\0';
+		len = next - line - 1;
+		if (len > 0 && line[len - 1] == '\r')
+			line[--len] = '\0';
 
 		if (io_debug)
-			fprintf(stderr, ">>> %s\n", buf);
+			fprintf(stderr, ">>> %s\n", line);
 
-		if (buflen == 0)
-			break; /* end of headers */
+		if (line == headers->raw) {
+			if (sscanf(line, "%*s %u %*s", &code) != 1)
+				errx(1, "%s: failed to extract status code",
+				    __func__);
 
-		if ((p = header_lookup(buf, "Content-Length:")) != NULL) {
-			headers->content_length = strtonum(p, 0, INT64_MAX, &e);
-			if (e)
-				err(1, "%s: Content-Length is %s: %lld",
-				    __func__, e, headers->content_length);
+			if (code < 100 || code > 511)
+				errx(1, "%s: invalid status code %d",
+				    __func__, code);
+
+			headers->keepalive = strncmp(line, "HTTP/1.0", 8) != 0;
+			continue;
 		}
 
-		if ((p = header_lookup(buf, "Location:")) != NULL)
-			headers->location = xstrdup(p);
+		/* skip the empty line ending the block and folded lines */
+		if (len == 0 || *line == ' ' || *line == '\t')
+			continue;
+
+		if ((p = memchr(line, ':', len)) == NULL)
+			errx(1, "%s: invalid header: %s", __func__, line);
 
-		if ((p = header_lookup(buf, "Transfer-Encoding:")) != NULL)
+		name = line;
+		namelen = p - line;
+		p += strspn(p + 1, " \t") + 1;
+		while (line + len > p &&
+		    (line[len - 1] == ' ' || line[len - 1] == '\t'))
+			line[--len] = '\0';
+
+		switch (header_id(name, namelen)) {
+		case H_ACCEPT_RANGES:
+			headers->accept_ranges = p;
+			break;
+		case H_CONNECTION:
+			headers->connection = p;
+			if (strcasestr(p, "close") != NULL)
+				headers->keepalive = 0;
+			else if (strcasestr(p, "keep-alive") != NULL)
+				headers->keepalive = 1;
+			break;
+		case H_CONTENT_ENCODING:
+			headers->content_encoding = p;
+			break;
+		case H_CONTENT_LENGTH:
+			headers->content_length = strtonum(p, 0, INT64_MAX, &e);
+			if (e)
+				errx(1, "%s: Content-Length is %s: %s",
+				    __func__, e, p);
+			break;
+		case H_CONTENT_RANGE:
+			headers->content_range = p;
+			break;
+		case H_ETAG:
+			headers->etag = p;
+			break;
+		case H_KEEP_ALIVE:
+			keepalive_parse(p, headers);
+			break;
+		case H_LAST_MODIFIED:
+			headers->last_modified = p;
+			break;
+		case H_LOCATION:
+			headers->location = p;
+			break;
+		case H_RETRY_AFTER:
+			headers->retry_after = p;
+			break;
+		case H_TRANSFER_ENCODING:
 			if (strcasestr(p, "chunked") != NULL)
 				headers->chunked = 1;
+			break;
+		}
+	}
 
+	/* Transfer-Encoding overrides Content-Length, RFC 7230 3.3.3 */
+	if (headers->chunked)
+		headers->content_length = -1;
+
+	/* whatever the headers say, these never have a body */
+	if (code == 204 || code == 304) {
+		headers->chunked = 0;
+		headers->content_length = 0;
+		headers->content_encoding = NULL;
 	}
 
 	*hdrs = headers;
-	free(buf);
 	return code;
 }
 
-static void
-http_headers_free(struct http_headers *headers)
+/*
+ * Wait until the connection buffer holds the status line and all the
+ * headers, returns the length of the block or 0 on EOF before any data.
+ */
+static size_t
+headers_read(void)
 {
-	if (headers == NULL)
-		return;
+	char	*buf, *nl;
+	size_t	 line = 0, off = 0;
 
-	free(headers->location);
-	free(headers);
+	if (io->len == 0 && iobuf_fill(io) == 0)
+		return 0;
+
+	for (;;) {
+		buf = io->buf + io->off;
+		while ((nl = memchr(buf + off, '\n', io->len - off)) != NULL) {
+			off = nl - buf + 1;
+			/* an empty line, other than the status line, ends it */
+			if (line != 0 && (nl == buf + line ||
+			    (nl == buf + line + 1 && buf[line] == '\r')))
+				return off;
+
+			line = off;
+		}
+
+		off = io->len;
+		if (io->len == io->size)
+			errx(1, "%s: headers too long", __func__);
+
+		if (iobuf_fill(io) == 0) {
+			if (io->len == 0)
+				return 0;
+
+			errx(1, "%s: connection closed in headers", __func__);
+		}
+	}
 }
 
-static char *
-header_lookup(const char *buf, const char *key)
+/*
+ * Map a header name to its H_* id, switching on the length first so
+ * that at most a couple of names are compared.
+ */
+static int
+header_id(const char *name, size_t len)
 {
-	char	*p;
+	switch (len) {
+	case 4:
+		if (strncasecmp(name, "ETag", len) == 0)
+			return H_ETAG;
+		break;
+	case 8:
+		if (strncasecmp(name, "Location", len) == 0)
+			return H_LOCATION;
+		break;
+	case 10:
+		if (strncasecmp(name, "Connection", len) == 0)
+			return H_CONNECTION;
+		if (strncasecmp(name, "Keep-Alive", len) == 0)
+			return H_KEEP_ALIVE;
+		break;
+	case 11:
+		if (strncasecmp(name, "Retry-After", len) == 0)
+			return H_RETRY_AFTER;
+		break;
+	case 13:
+		if (strncasecmp(name, "Accept-Ranges", len) == 0)
+			return H_ACCEPT_RANGES;
+		if (strncasecmp(name, "Content-Range", len) == 0)
+			return H_CONTENT_RANGE;
+		if (strncasecmp(name, "Last-Modified", len) == 0)
+			return H_LAST_MODIFIED;
+		break;
+	case 14:
+		if (strncasecmp(name, "Content-Length", len) == 0)
+			return H_CONTENT_LENGTH;
+		break;
+	case 16:
+		if (strncasecmp(name, "Content-Encoding", len) == 0)
+			return H_CONTENT_ENCODING;
+		break;
+	case 17:
+		if (strncasecmp(name, "Transfer-Encoding", len) == 0)
+			return H_TRANSFER_ENCODING;
+		break;
+	}
 
-	if (strncasecmp(buf, key, strlen(key)) == 0) {
-		if ((p = strchr(buf, ' ')) == NULL)
-			errx(1, "Failed to parse %s", key);
-		return ++p;
+	return H_UNKNOWN;
+}
+
+static void
+keepalive_parse(char *p, struct http_headers *headers)
+{
+	const char	*e;
+	char		*param;
+	long long	 val;
+
+	while ((param = strsep(&p, ",")) != NULL) {
+		param += strspn(param, " \t");
+		if (strncasecmp(param, "timeout=", 8) == 0) {
+			val = strtonum(param + 8, 0, INT_MAX, &e);
+			if (e == NULL)
+				headers->keepalive_timeout = val;
+		} else if (strncasecmp(param, "max=", 4) == 0) {
+			val = strtonum(param + 4, 0, INT_MAX, &e);
+			if (e == NULL && val == 0)
+				headers->keepalive = 0;
+		}
 	}
+}
+
+static void
+http_headers_free(struct http_headers *headers)
+{
+	if (headers == NULL)
+		return;
 
-	return NULL;
+	free(headers);
 }
 
 static const char *
@@ -578,62 +1317,6 @@ http_status_cmp(const void *a, const void *b)
 	return (ea->code - eb->code);
 }
 
-
-static ssize_t
-http_getline(int scheme, char **buf, size_t *n)
-{
-	ssize_t	buflen;
-
-	switch (scheme) {
-#ifndef NOSSL
-	case S_HTTPS:
-		if ((buflen = tls_getline(buf, n, ctx)) == -1)
-			errx(1, "%s: tls_getline", __func__);
-		break;
-#endif
-	case S_FTP:
-	case S_HTTP:
-		if ((buflen = getline(buf, n, fp)) == -1)
-			err(1, "%s: getline", __func__);
-		break;
-	default:
-		errx(1, "%s: invalid scheme", __func__);
-	}
-
-	return buflen;
-}
-
-static size_t
-http_read(int scheme, char *buf, size_t size)
-{
-	size_t	r;
-#ifndef NOSSL
-	ssize_t	rs;
-#endif
-
-	switch (scheme) {
-#ifndef NOSSL
-	case S_HTTPS:
-		do {
-			rs = tls_read(ctx, buf, size);
-		} while (rs == TLS_WANT_POLLIN || rs == TLS_WANT_POLLOUT);
-		if (rs == -1)
-			errx(1, "%s: tls_read: %s", __func__, tls_error(ctx));
-		r = rs;
-		break;
-#endif
-	case S_HTTP:
-		if ((r = fread(buf, 1, size, fp)) < size)
-			if (!feof(fp))
-				errx(1, "%s: fread", __func__);
-		break;
-	default:
-		errx(1, "%s: invalid scheme", __func__);
-	}
-
-	return r;
-}
-
 #ifndef NOSSL
 void
 https_init(char *tls_options)
@@ -709,74 +1392,4 @@ https_init(char *tls_options)
 	if (tls_config_set_ca_file(tls_config, ca_file) == -1)
 		errx(1, "tls_config_set_ca_file failed");
 }
-
-static ssize_t
-tls_getline(char **buf, size_t *buflen, struct tls *tls)
-{
-	char		*newb;
-	size_t		 newlen, off;
-	int		 ret;
-	unsigned char	 c;
-
-	if (buf == NULL || buflen == NULL)
-		return -1;
-
-	/* If buf is NULL, we have to assume a size of zero */
-	if (*buf == NULL)
-		*buflen = 0;
-
-	off = 0;
-	do {
-		do {
-			ret = tls_read(tls, &c, 1);
-		} while (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT);
-		if (ret == -1)
-			return -1;
-
-		/* Ensure we can handle it */
-		if (off + 2 > SSIZE_MAX)
-			return -1;
-
-		newlen = off + 2; /* reserve space for NUL terminator */
-		if (newlen > *buflen) {
-			newlen = newlen < MINBUF ? MINBUF : *buflen * 2;
-			newb = recallocarray(*buf, *buflen, newlen, 1);
-			if (newb == NULL)
-				return -1;
-
-			*buf = newb;
-			*buflen = newlen;
-		}
-
-		*(*buf + off) = c;
-		off += 1;
-	} while (c != '\n');
-
-	*(*buf + off) = '\0';
-	return off;
-}
-
-static void
-tls_copy_file(struct url *url, FILE *dst_fp, off_t *offset)
-{
-	char	*tmp_buf;
-	ssize_t	 r;
-
-	tmp_buf = xmalloc(TMPBUF_LEN);
-	for (;;) {
-		do {
-			r = tls_read(ctx, tmp_buf, TMPBUF_LEN);
-		} while (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT);
-
-		if (r == -1)
-			errx(1, "%s: tls_read: %s", __func__, tls_error(ctx));
-		else if (r == 0)
-			break;
-
-		*offset += r;
-		if (fwrite(tmp_buf, 1, r, dst_fp) != (size_t)r)
-			err(1, "%s: fwrite", __func__);
-	}
-	free(tmp_buf);
-}
 #endif /* NOSSL */
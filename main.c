@@ -14,8 +14,13 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE	/* fallocate(2) */
+#endif
+
 #include <sys/cdefs.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
@@ -26,6 +31,7 @@
 #include <fcntl.h>
 #include <imsg.h>
 #include <libgen.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,24 +41,44 @@
 #include "ftp.h"
 #include "xmalloc.h"
 
+#define CONNECT_DELAY	250	/* RFC 8305 Connection Attempt Delay */
+#define DNS_TTL		60
+#define MAX_JOBS	64
+#define MAX_PIPELINE	32
+#define MAX_SEGMENTS	16
+#define MIN_SEGMENT_SZ	(1024 * 1024)
+
 static int		 auto_fetch(int, char **, int, char **);
 static void		 child(int, int, char **);
-static int		 parent(int, pid_t, int, char **);
+static int		 fetch_url(void);
+static int		 next_url(void);
+static int		 parent(int, int *, pid_t *, int, char **);
+static void		 pipeline_fill(char **);
+static void		 prefetch_hosts(int, char **);
+static void		 preallocate(int, off_t, off_t);
 static struct url	*proxy_parse(const char *);
 static struct url	*get_proxy(int);
 static void		 re_exec(int, int, char **);
+static void		 save_segments(struct url *, struct url *, off_t *,
+			    off_t, int);
 static void		 validate_output_fname(struct url *, const char *);
+static void		 validators_load(struct url *);
+static void		 validators_save(struct url *, int);
 static __dead void	 usage(void);
 
 struct imsgbuf		 child_ibuf;
 const char		*useragent = "OpenBSD ftp";
-int			 activemode, family = AF_UNSPEC, io_debug;
-int			 progressmeter, verbose = 1;
+int			 activemode, compressed, family = AF_UNSPEC, io_debug;
+int			 connect_delay = CONNECT_DELAY, dns_ttl = DNS_TTL;
+int			 modez = MODEZ_AUTO, progressmeter, segments = 1;
+int			 verbose = 1;
 volatile sig_atomic_t	 interrupted = 0;
 
-static const char	*title;
-static char		*tls_options, *oarg;
-static int		 connect_timeout, resume;
+static const char	*report_fmt, *title;
+static char		*report_file, *tls_options, *oarg;
+static int		 connect_timeout, jobs = 1, pipeline, resume;
+static int		 timestamping;
+static int		 lookahead[MAX_PIPELINE], nlookahead;
 
 int
 main(int argc, char **argv)
@@ -76,7 +102,7 @@ main(int argc, char **argv)
 	save_argc = argc;
 	save_argv = argv;
 	while ((ch = getopt(argc, argv,
-	    "46AaCc:dD:Eegik:Mmno:pP:r:S:s:tU:vVwxz:")) != -1) {
+	    "46AaCc:dD:EeF:gij:J:k:K:MmNno:pP:r:R:S:s:T:tU:vVw:W:xX:Zz:")) != -1) {
 		switch (ch) {
 		case '4':
 			family = AF_INET;
@@ -93,6 +119,24 @@ main(int argc, char **argv)
 		case 'D':
 			title = optarg;
 			break;
+		case 'F':
+			report_fmt = optarg;
+			break;
+		case 'j':
+			segments = strtonum(optarg, 1, MAX_SEGMENTS, &e);
+			if (e)
+				errx(1, "-j: %s", e);
+			break;
+		case 'J':
+			jobs = strtonum(optarg, 1, MAX_JOBS, &e);
+			if (e)
+				errx(1, "-J: %s", e);
+			break;
+		case 'K':
+			pipeline = strtonum(optarg, 0, MAX_PIPELINE, &e);
+			if (e)
+				errx(1, "-K: %s", e);
+			break;
 		case 'o':
 			oarg = optarg;
 			if (!strlen(oarg))
@@ -104,9 +148,20 @@ main(int argc, char **argv)
 		case 'm':
 			progressmeter = 1;
 			break;
+		case 'N':
+			timestamping = 1;
+			break;
+		case 'R':
+			dns_ttl = strtonum(optarg, 0, 86400, &e);
+			if (e)
+				errx(1, "-R: %s", e);
+			break;
 		case 'S':
 			tls_options = optarg;
 			break;
+		case 'T':
+			report_file = optarg;
+			break;
 		case 'U':
 			useragent = optarg;
 			break;
@@ -118,6 +173,18 @@ main(int argc, char **argv)
 			if (e)
 				errx(1, "-w: %s", e);
 			break;
+		case 'W':
+			connect_delay = strtonum(optarg, 10, 2000, &e);
+			if (e)
+				errx(1, "-W: %s", e);
+			break;
+		case 'X':
+			if ((modez = modez_lookup(optarg)) == -1)
+				errx(1, "-X: invalid mode %s", optarg);
+			break;
+		case 'Z':
+			compressed = 1;
+			break;
 		/* options for internal use only */
 		case 'x':
 			rexec = 1;
@@ -151,6 +218,15 @@ main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
+	/* a single output file can't be shared by concurrent transfers */
+	if (oarg)
+		jobs = 1;
+	if (jobs > argc)
+		jobs = argc;
+	/* concurrent progress meters would garble the terminal */
+	if (jobs > 1)
+		progressmeter = 0;
+
 	if (rexec)
 		child(csock, argc, argv);
 
@@ -191,22 +267,30 @@ main(int argc, char **argv)
 static int
 auto_fetch(int argc, char **argv, int sargc, char **sargv)
 {
-	pid_t	  pid;
-	int	  sp[2];
+	pid_t	 *pids;
+	int	 *socks, i, j, sp[2];
 
-	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, sp) != 0)
-		err(1, "socketpair");
+	socks = xcalloc(jobs, sizeof(*socks));
+	pids = xcalloc(jobs, sizeof(*pids));
+	for (i = 0; i < jobs; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, sp) != 0)
+			err(1, "socketpair");
 
-	switch (pid = fork()) {
-	case -1:
-		err(1, "fork");
-	case 0:
-		close(sp[0]);
-		re_exec(sp[1], sargc, sargv);
+		switch (pids[i] = fork()) {
+		case -1:
+			err(1, "fork");
+		case 0:
+			for (j = 0; j < i; j++)
+				close(socks[j]);
+			close(sp[0]);
+			re_exec(sp[1], sargc, sargv);
+		}
+
+		close(sp[1]);
+		socks[i] = sp[0];
 	}
 
-	close(sp[1]);
-	return parent(sp[0], pid, argc, argv);
+	return parent(jobs, socks, pids, argc, argv);
 }
 
 static void
@@ -230,93 +314,182 @@ re_exec(int sock, int argc, char **argv)
 	err(1, "execvp");
 }
 
+/*
+ * Serve file opens for the children and hand out the URLs to fetch, one
+ * at a time, to whichever child asks next. No further URLs are handed
+ * out once a child has failed.
+ */
 static int
-parent(int sock, pid_t child_pid, int argc, char **argv)
+parent(int nchild, int *socks, pid_t *pids, int argc, char **argv)
 {
-	struct imsgbuf	 ibuf;
+	struct imsgbuf	*ibufs;
+	struct pollfd	*pfds;
 	struct imsg	 imsg;
 	struct stat	 sb;
 	off_t		 offset;
-	int		 fd, save_errno, sig, status;
+	int		 alive, failed, fd, i, idx, next, ret, save_errno;
+	int		 sig, status;
 
 	setproctitle("%s", "parent");
 	if (pledge("stdio cpath rpath wpath sendfd", NULL) == -1)
 		err(1, "pledge");
 
-	imsg_init(&ibuf, sock);
-	for (;;) {
-		if (read_message(&ibuf, &imsg) == 0)
-			break;
-
-		if (imsg.hdr.type != IMSG_OPEN)
-			errx(1, "%s: IMSG_OPEN expected", __func__);
-
-		offset = 0;
-		fd = open(imsg.data, imsg.hdr.peerid, 0666);
-		save_errno = errno;
-		if (fd != -1)
-			if (fstat(fd, &sb) == 0)
-				offset = sb.st_size;
-
-		send_message(&ibuf, IMSG_OPEN, save_errno,
-		    &offset, sizeof offset, fd);
-		imsg_free(&imsg);
+	ibufs = xcalloc(nchild, sizeof(*ibufs));
+	pfds = xcalloc(nchild, sizeof(*pfds));
+	for (i = 0; i < nchild; i++) {
+		imsg_init(&ibufs[i], socks[i]);
+		pfds[i].fd = socks[i];
+		pfds[i].events = POLLIN;
 	}
 
-	close(sock);
-	if (waitpid(child_pid, &status, 0) == -1 && errno != ECHILD)
-		err(1, "wait");
+	failed = next = ret = 0;
+	for (alive = nchild; alive > 0;) {
+		if (poll(pfds, nchild, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
 
-	sig = WTERMSIG(status);
-	if (WIFSIGNALED(status) && sig != SIGPIPE)
-		errx(1, "child terminated: signal %d", sig);
+		for (i = 0; i < nchild; i++) {
+			if (pfds[i].fd == -1 || pfds[i].revents == 0)
+				continue;
+
+			if (read_message(&ibufs[i], &imsg) == 0) {
+				close(pfds[i].fd);
+				pfds[i].fd = -1;
+				alive--;
+				if (waitpid(pids[i], &status, 0) == -1 &&
+				    errno != ECHILD)
+					err(1, "wait");
+
+				sig = WTERMSIG(status);
+				if (WIFSIGNALED(status) && sig != SIGPIPE)
+					errx(1, "child terminated: signal %d",
+					    sig);
+
+				if (WIFEXITED(status) &&
+				    WEXITSTATUS(status) != 0) {
+					failed = 1;
+					ret = WEXITSTATUS(status);
+				}
+				continue;
+			}
+
+			switch (imsg.hdr.type) {
+			case IMSG_OPEN:
+				offset = 0;
+				fd = open(imsg.data, imsg.hdr.peerid, 0666);
+				save_errno = errno;
+				if (fd != -1)
+					if (fstat(fd, &sb) == 0)
+						offset = sb.st_size;
+
+				send_message(&ibufs[i], IMSG_OPEN, save_errno,
+				    &offset, sizeof offset, fd);
+				break;
+			case IMSG_NEXT:
+				idx = (failed || next == argc) ? -1 : next++;
+				send_message(&ibufs[i], IMSG_NEXT, 0,
+				    &idx, sizeof idx, -1);
+				break;
+			default:
+				errx(1, "%s: unexpected message %u", __func__,
+				    imsg.hdr.type);
+			}
+			imsg_free(&imsg);
+		}
+	}
 
-	return WEXITSTATUS(status);
+	free(ibufs);
+	free(pfds);
+	return ret;
 }
 
 static void
 child(int sock, int argc, char **argv)
 {
-	struct url	*url;
+	struct url	*proxy, *url;
 	FILE		*dst_fp;
-	char		*p;
+	char		*p, *promises;
 	off_t		 offset, sz;
-	int		 fd, i, tostdout;
+	int		 fd, i, nsegs, report_fd = -1, tostdout, validated;
 
 	setproctitle("%s", "child");
 #ifndef NOSSL
 	https_init(tls_options);
 #endif
-	if (pledge("stdio inet dns recvfd tty", NULL) == -1)
-		err(1, "pledge");
-	if (!progressmeter && pledge("stdio inet dns recvfd", NULL) == -1)
+	/* segmented downloads fork a process per segment */
+	xasprintf(&promises, "stdio inet dns recvfd%s%s",
+	    progressmeter ? " tty" : "", segments > 1 ? " proc" : "");
+	if (pledge(promises, NULL) == -1)
 		err(1, "pledge");
+	free(promises);
 
 	imsg_init(&child_ibuf, sock);
 	tostdout = oarg && (strcmp(oarg, "-") == 0);
 	if (resume && tostdout)
 		errx(1, "can't append to stdout");
 
-	for (i = 0; i < argc; i++) {
+	if (report_file) {
+		report_fd = fd_request(report_file,
+		    O_WRONLY|O_CREAT|O_APPEND, NULL);
+		if (report_fd == -1)
+			err(1, "Can't open file %s", report_file);
+	} else if (report_fmt)
+		report_fd = STDERR_FILENO;
+
+	/*
+	 * With -J the URLs are handed out one at a time, a job only knows
+	 * its own as it gets them and resolves each when connecting.
+	 */
+	if (argc > 1 && jobs == 1)
+		prefetch_hosts(argc, argv);
+
+	while ((i = next_url()) != -1) {
 		fd = -1;
 		offset = sz = 0;
+		timing_reset();
 
 		if ((url = url_parse(argv[i])) == NULL)
 			exit(1);
 
 		validate_output_fname(url, argv[i]);
-		url_connect(url, get_proxy(url->scheme), connect_timeout);
+		proxy = get_proxy(url->scheme);
+		url_connect(url, proxy, connect_timeout);
 		if (resume)
 			fd = fd_request(url->fname, O_WRONLY|O_APPEND, &offset);
 
-		url = url_request(url, get_proxy(url->scheme), &offset, &sz);
+		validated = 0;
+		if (timestamping && !tostdout) {
+			validators_load(url);
+			validated = url->etag || url->last_modified;
+		}
+
+		url = url_request(url, proxy, connect_timeout, &offset, &sz);
+		/* ranged requests depend on state known only when they're due */
+		if (pipeline && !resume && segments == 1)
+			pipeline_fill(argv);
+
+		if (url->not_modified) {
+			log_info("%s is up to date\n", url->fname);
+			timing_mark(TIMING_END);
+			if (report_fd != -1)
+				timing_report(report_fd, report_fmt, argv[i], 0);
+			if (fd != -1)
+				close(fd);
+			url_close(url);
+			url_free(url);
+			continue;
+		}
+
 		if (resume && offset == 0 && fd != -1)
 			if (ftruncate(fd, 0) != 0)
 				err(1, "ftruncate");
 
+		/* readable too, fd_splice() may map it */
 		if (fd == -1 && !tostdout &&
 		    (fd = fd_request(url->fname,
-		    O_CREAT|O_TRUNC|O_WRONLY, NULL)) == -1)
+		    O_CREAT|O_TRUNC|O_RDWR, NULL)) == -1)
 			err(1, "Can't open file %s", url->fname);
 
 		if (tostdout)
@@ -324,17 +497,59 @@ child(int sock, int argc, char **argv)
 		else if ((dst_fp = fdopen(fd, "w")) == NULL)
 			err(1, "%s: fdopen", __func__);
 
+		if (!tostdout && !url->encoded && sz > offset)
+			preallocate(fd, offset, sz - offset);
+
 		if (progressmeter) {
 			p = basename(url->path);
 			start_progress_meter(p, title, sz, &offset);
 		}
 
-		url_save(url, dst_fp, &offset);
+		nsegs = 1;
+		if (segments > 1 && !tostdout && url->ranges) {
+			nsegs = (sz - offset) / MIN_SEGMENT_SZ;
+			if (nsegs > segments)
+				nsegs = segments;
+		}
+
+		if (nsegs > 1)
+			save_segments(url, proxy, &offset, sz, nsegs);
+		else
+			url_save(url, dst_fp, &offset);
+
+		timing_mark(TIMING_END);
+
 		if (progressmeter)
 			stop_progress_meter();
 
-		if (!tostdout)
+		if (!tostdout) {
+			/* release the space reserved past a short transfer */
+			if (!url->encoded && offset < sz &&
+			    (fflush(dst_fp) == EOF || ftruncate(fd, offset) == -1))
+				err(1, "%s: ftruncate", __func__);
+
 			fclose(dst_fp);
+		}
+
+		/*
+		 * A partial file must not be mistaken for a current one,
+		 * any validators left by an earlier run are emptied.
+		 * The length of a chunked or decoded body is only known
+		 * to be complete from reaching its end without an error.
+		 */
+		if (timestamping && !tostdout) {
+			if (interrupted ||
+			    (sz != 0 && !url->encoded && offset != sz)) {
+				free(url->etag);
+				free(url->last_modified);
+				url->etag = url->last_modified = NULL;
+				validated = 1;
+			}
+			validators_save(url, validated);
+		}
+
+		if (report_fd != -1)
+			timing_report(report_fd, report_fmt, argv[i], offset);
 
 		url_close(url);
 		url_free(url);
@@ -343,6 +558,306 @@ child(int sock, int argc, char **argv)
 	exit(0);
 }
 
+/*
+ * Split the remainder of the file into nsegs byte ranges and fetch them
+ * in parallel, one process and connection per range, each writing at its
+ * own offset. The first range is read off the connection that already
+ * carries the response to the probing request.
+ */
+static void
+save_segments(struct url *url, struct url *proxy, off_t *offset, off_t sz,
+    int nsegs)
+{
+	FILE	*fp;
+	off_t	*counters, len, start, total;
+	pid_t	*pids, pid;
+	int	 fd, i, failed, running, status;
+
+	counters = mmap(NULL, nsegs * sizeof(*counters),
+	    PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED, -1, 0);
+	if (counters == MAP_FAILED)
+		err(1, "%s: mmap", __func__);
+
+	pids = xcalloc(nsegs, sizeof(*pids));
+	len = (sz - *offset) / nsegs;
+	for (i = 0; i < nsegs; i++) {
+		start = *offset + i * len;
+		if (i == nsegs - 1)
+			len = sz - start;
+
+		/* a descriptor of its own so that each has its own offset */
+		if ((fd = fd_request(url->fname, O_RDWR, NULL)) == -1)
+			err(1, "Can't open file %s", url->fname);
+
+		switch (pids[i] = fork()) {
+		case -1:
+			err(1, "%s: fork", __func__);
+		case 0:
+			verbose = 0;
+			if ((fp = fdopen(fd, "w")) == NULL)
+				err(1, "%s: fdopen", __func__);
+			if (fseeko(fp, start, SEEK_SET) == -1)
+				err(1, "%s: fseeko", __func__);
+
+			if (i == 0) {
+				url->content_length = len;
+				url_save(url, fp, &counters[i]);
+			} else
+				url_save_range(url, proxy, connect_timeout,
+				    start, len, fp, &counters[i]);
+
+			if (fclose(fp) != 0)
+				err(1, "%s: fclose", __func__);
+			if (counters[i] != len)
+				errx(1, "segment %d: short transfer, "
+				    "%lld of %lld bytes", i,
+				    (long long)counters[i], (long long)len);
+			exit(0);
+		}
+		close(fd);
+	}
+
+	start = *offset;
+	failed = 0;
+	for (running = nsegs; running > 0 && !failed;) {
+		while (running > 0 &&
+		    (pid = waitpid(WAIT_ANY, &status, WNOHANG)) > 0) {
+			/* reaped, its pid may be handed out again */
+			for (i = 0; i < nsegs; i++)
+				if (pids[i] == pid)
+					pids[i] = -1;
+
+			running--;
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				failed = 1;
+		}
+
+		for (total = 0, i = 0; i < nsegs; i++)
+			total += counters[i];
+
+		*offset = start + total;
+		if (running > 0 && !failed)
+			(void)poll(NULL, 0, 100);
+	}
+
+	if (failed) {
+		for (i = 0; i < nsegs; i++)
+			if (pids[i] != -1)
+				(void)kill(pids[i], SIGTERM);
+
+		for (i = 0; i < nsegs; i++)
+			if (pids[i] != -1)
+				(void)waitpid(pids[i], NULL, 0);
+
+		/* keep what -C can resume, the first segment is contiguous */
+		if ((fd = fd_request(url->fname, O_WRONLY, NULL)) != -1) {
+			(void)ftruncate(fd, start + counters[0]);
+			close(fd);
+		}
+
+		errx(1, "Segmented transfer of %s failed", url->fname);
+	}
+
+	free(pids);
+	munmap(counters, nsegs * sizeof(*counters));
+}
+
+/*
+ * Read the validators recorded for the output file by an earlier run,
+ * they are only of use if the file is still there.
+ */
+static void
+validators_load(struct url *url)
+{
+	FILE	*fp;
+	char	*line = NULL, *path;
+	size_t	 n = 0;
+	int	 fd;
+
+	if (url->scheme != S_HTTP && url->scheme != S_HTTPS)
+		return;
+
+	if ((fd = fd_request(url->fname, O_RDONLY, NULL)) == -1)
+		return;
+
+	close(fd);
+	xasprintf(&path, "%s.validators", url->fname);
+	fd = fd_request(path, O_RDONLY, NULL);
+	free(path);
+	if (fd == -1)
+		return;
+
+	if ((fp = fdopen(fd, "r")) == NULL)
+		err(1, "%s: fdopen", __func__);
+
+	while (getline(&line, &n, fp) != -1) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (strncmp(line, "ETag: ", 6) == 0) {
+			free(url->etag);
+			url->etag = xstrdup(line + 6);
+		} else if (strncmp(line, "Last-Modified: ", 15) == 0) {
+			free(url->last_modified);
+			url->last_modified = xstrdup(line + 15);
+		}
+	}
+
+	free(line);
+	fclose(fp);
+}
+
+/*
+ * Record the validators of the response next to the output file. The
+ * file is only emptied if there are none and a previous run left some.
+ */
+static void
+validators_save(struct url *url, int validated)
+{
+	FILE	*fp;
+	char	*path;
+	int	 fd;
+
+	if (url->scheme != S_HTTP && url->scheme != S_HTTPS)
+		return;
+
+	if (url->etag == NULL && url->last_modified == NULL && !validated)
+		return;
+
+	xasprintf(&path, "%s.validators", url->fname);
+	fd = fd_request(path, O_CREAT|O_TRUNC|O_WRONLY, NULL);
+	if (fd == -1) {
+		warn("Can't open file %s", path);
+		free(path);
+		return;
+	}
+
+	free(path);
+	if ((fp = fdopen(fd, "w")) == NULL)
+		err(1, "%s: fdopen", __func__);
+
+	if (url->etag)
+		fprintf(fp, "ETag: %s\n", url->etag);
+	if (url->last_modified)
+		fprintf(fp, "Last-Modified: %s\n", url->last_modified);
+
+	if (fclose(fp) != 0)
+		warn("%s: fclose", __func__);
+}
+
+/*
+ * Reserve the blocks for the len bytes expected at offset so that the
+ * file is laid out in few extents and segments written out of order
+ * don't each allocate. The file size is left alone, an O_APPEND
+ * descriptor would otherwise write past the reserved area. Failure
+ * is harmless, the file then just grows as it is written.
+ *
+ * This needs fallocate(2) with FALLOC_FL_KEEP_SIZE, which only Linux
+ * has. OpenBSD can't reserve blocks without changing the file size,
+ * so this does nothing there.
+ */
+static void
+preallocate(int fd, off_t offset, off_t len)
+{
+#ifdef __linux__
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, len) == -1 &&
+	    errno != EOPNOTSUPP && errno != ENOSYS)
+		warn("%s: fallocate", __func__);
+#endif
+}
+
+/*
+ * Resolve the hosts of all URLs in the batch in parallel up front,
+ * connections then find them in the resolver cache. Only for a single
+ * job, which fetches every URL of the batch itself.
+ */
+static void
+prefetch_hosts(int argc, char **argv)
+{
+	struct url	*proxy, *url;
+	int		 i;
+
+	for (i = 0; i < argc; i++) {
+		if (scheme_lookup(argv[i]) == -1 ||
+		    (url = url_parse(argv[i])) == NULL)
+			continue;
+
+		if ((proxy = get_proxy(url->scheme)) != NULL)
+			dns_prefetch(proxy->host, proxy->port);
+		else if (url->scheme != S_FILE)
+			dns_prefetch(url->host, url->port);
+
+		url_free(url);
+	}
+
+	dns_prefetch_run();
+}
+
+/*
+ * Return the index of the next URL to fetch, -1 when there are none left.
+ * URLs taken ahead for pipelining come first.
+ */
+static int
+next_url(void)
+{
+	int	idx;
+
+	if (nlookahead == 0)
+		return fetch_url();
+
+	idx = lookahead[0];
+	memmove(lookahead, lookahead + 1, --nlookahead * sizeof(*lookahead));
+	return idx;
+}
+
+/*
+ * Take up to pipeline URLs ahead and send their requests on the current
+ * connection, stopping at the first one that needs a connection of its
+ * own.
+ */
+static void
+pipeline_fill(char **argv)
+{
+	struct url	*url;
+	int		 i, sent;
+
+	for (sent = 1; sent && nlookahead < pipeline;) {
+		if ((i = fetch_url()) == -1)
+			return;
+
+		lookahead[nlookahead++] = i;
+		if (scheme_lookup(argv[i]) == -1 ||
+		    (url = url_parse(argv[i])) == NULL)
+			return;
+
+		/* the request has to carry the same validators when due */
+		if (timestamping && !(oarg && strcmp(oarg, "-") == 0)) {
+			url->fname = xstrdup(oarg ? oarg : basename(url->path));
+			validators_load(url);
+		}
+
+		sent = url_pipeline(url, get_proxy(url->scheme));
+		url_free(url);
+	}
+}
+
+static int
+fetch_url(void)
+{
+	struct imsg	imsg;
+	int		idx;
+
+	send_message(&child_ibuf, IMSG_NEXT, 0, NULL, 0, -1);
+	if (read_message(&child_ibuf, &imsg) == 0)
+		return -1;
+
+	if (imsg.hdr.type != IMSG_NEXT ||
+	    imsg.hdr.len - IMSG_HEADER_SIZE != sizeof idx)
+		errx(1, "%s: IMSG_NEXT expected", __func__);
+
+	memcpy(&idx, imsg.data, sizeof idx);
+	imsg_free(&imsg);
+	return idx;
+}
+
 static struct url *
 get_proxy(int scheme)
 {
@@ -400,9 +915,11 @@ proxy_parse(const char *name)
 static __dead void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-46ACVM] [-D title] [-o output] "
-	    "[-S tls_options] [-U useragent] "
-	    "[-w seconds] url ...\n", getprogname());
+	fprintf(stderr, "usage: %s [-46ACMNVZ] [-D title] [-F format] "
+	    "[-J jobs] [-j segments] [-K depth] [-o output] [-R ttl] "
+	    "[-S tls_options] [-T file] [-U useragent] [-W delay] "
+	    "[-w seconds] [-X mode] url ...\n",
+	    getprogname());
 
 	exit(1);
 }
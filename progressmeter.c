@@ -25,11 +25,13 @@
 
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/time.h>
 
 #include <err.h>
 #include <errno.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
@@ -41,8 +43,6 @@
 #define UPDATE_INTERVAL 1	/* update the progress meter every second */
 #define STALL_TIME 5		/* we're stalled after this many seconds */
 
-time_t	monotime(void);
-
 /* formats and inserts the specified size into the given buffer */
 static void format_size(char *, int, off_t);
 static void format_rate(char *, int, off_t);
@@ -57,6 +57,10 @@ void refresh_progress_meter(void);
 /* signal handler for updating the progress meter */
 static void update_progress_meter(int);
 
+/* timing report helpers */
+static void json_escape(FILE *, const char *);
+static int timing_var(FILE *, const char *, size_t, const char *, off_t);
+
 static const char *title;	/* short title for the start of progress bar */
 static time_t start;		/* start progress */
 static time_t last_update;	/* last progress update */
@@ -73,6 +77,20 @@ static const char *filename;	/* To be displayed in non-verbose mode */
 /* units for format_size */
 static const char unit[] = " KMGT";
 
+/* time each phase of the current transfer completed, if it did */
+static struct timespec phases[TIMING_NPHASES];
+static int phase_done[TIMING_NPHASES];
+
+/* timing report variables, curl -w names */
+static const char *timing_vars[TIMING_NPHASES] = {
+	NULL,
+	"time_namelookup",
+	"time_connect",
+	"time_appconnect",
+	"time_starttransfer",
+	"time_total",
+};
+
 time_t
 monotime(void)
 {
@@ -351,3 +369,139 @@ setscreensize(void)
 		win_size = DEFAULT_WINSIZE;
 	win_size += 1;					/* trailing \0 */
 }
+
+/*
+ * Start timing a new transfer.
+ */
+void
+timing_reset(void)
+{
+	memset(phase_done, 0, sizeof phase_done);
+	timing_mark(TIMING_START);
+}
+
+/*
+ * Record the completion of a phase of the current transfer, only the
+ * first one counts if a phase repeats, on redirection for instance.
+ */
+void
+timing_mark(int phase)
+{
+	if (phase_done[phase])
+		return;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &phases[phase]) != 0)
+		err(1, "%s: clock_gettime", __func__);
+
+	phase_done[phase] = 1;
+}
+
+/*
+ * Write the timing of the transfer of url to fd, as a JSON object on a
+ * line of its own if fmt is NULL. Otherwise fmt is expanded with %{var}
+ * replaced by the variable's value and \n, \t escapes interpreted. The
+ * report goes out in a single write so that reports of concurrent jobs
+ * don't interleave.
+ */
+void
+timing_report(int fd, const char *fmt, const char *url, off_t bytes)
+{
+	FILE		*fp;
+	char		*buf;
+	const char	*e;
+	size_t		 len;
+	int		 i;
+
+	if ((fp = open_memstream(&buf, &len)) == NULL)
+		err(1, "%s: open_memstream", __func__);
+
+	if (fmt == NULL) {
+		fprintf(fp, "{\"url\":\"");
+		json_escape(fp, url);
+		fprintf(fp, "\"");
+		for (i = TIMING_DNS; i < TIMING_NPHASES; i++) {
+			fprintf(fp, ",\"%s\":", timing_vars[i]);
+			if (phase_done[i])
+				(void)timing_var(fp, timing_vars[i],
+				    strlen(timing_vars[i]), url, bytes);
+			else
+				fprintf(fp, "null");
+		}
+		fprintf(fp, ",\"size_download\":%lld}\n", (long long)bytes);
+	}
+
+	for (; fmt && *fmt != '\0'; fmt++) {
+		if (fmt[0] == '%' && fmt[1] == '{' &&
+		    (e = strchr(fmt, '}')) != NULL &&
+		    timing_var(fp, fmt + 2, e - fmt - 2, url, bytes) == 0) {
+			fmt = e;
+			continue;
+		}
+
+		if (fmt[0] == '\\' && (fmt[1] == 'n' || fmt[1] == 't')) {
+			fputc(*++fmt == 'n' ? '\n' : '\t', fp);
+			continue;
+		}
+
+		if (fmt[0] == '%' && fmt[1] == '%')
+			fmt++;
+
+		fputc(*fmt, fp);
+	}
+
+	if (fclose(fp) != 0)
+		err(1, "%s: fclose", __func__);
+
+	if (write(fd, buf, len) == -1)
+		warn("%s: write", __func__);
+
+	free(buf);
+}
+
+/* prints the value of the variable name, returns -1 if there is none */
+static int
+timing_var(FILE *fp, const char *name, size_t len, const char *url,
+    off_t bytes)
+{
+	struct timespec	ts;
+	int		i;
+
+	if (len == 3 && strncmp(name, "url", len) == 0) {
+		fprintf(fp, "%s", url);
+		return 0;
+	}
+
+	if (len == 13 && strncmp(name, "size_download", len) == 0) {
+		fprintf(fp, "%lld", (long long)bytes);
+		return 0;
+	}
+
+	for (i = TIMING_DNS; i < TIMING_NPHASES; i++)
+		if (strncmp(name, timing_vars[i], len) == 0 &&
+		    timing_vars[i][len] == '\0')
+			break;
+
+	if (i == TIMING_NPHASES)
+		return -1;
+
+	/* seconds since the start of the transfer */
+	ts.tv_sec = ts.tv_nsec = 0;
+	if (phase_done[i])
+		timespecsub(&phases[i], &phases[TIMING_START], &ts);
+
+	fprintf(fp, "%lld.%09ld", (long long)ts.tv_sec, ts.tv_nsec);
+	return 0;
+}
+
+static void
+json_escape(FILE *fp, const char *s)
+{
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
+	}
+}
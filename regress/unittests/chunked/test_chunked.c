@@ -0,0 +1,150 @@
+/*
+ * Placed in the public domain.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <imsg.h>
+
+#include "http.c"
+
+#ifndef nitems
+#define nitems(_a)	(sizeof((_a)) / sizeof((_a)[0]))
+#endif
+
+struct imsgbuf		 child_ibuf;
+const char		*useragent = "OpenBSD ftp";
+int			 activemode, compressed, family = AF_UNSPEC, io_debug;
+int			 connect_delay, dns_ttl, modez, progressmeter;
+int			 segments = 1, verbose;
+volatile sig_atomic_t	 interrupted;
+
+/*
+ * The decoder must keep its state across buffer refills, each body is
+ * fed to it in reads of every one of these sizes.
+ */
+static const size_t	bufsizes[] = { 1, 2, 3, 5, 16, TMPBUF_LEN };
+
+static struct {
+	const char	*body;
+	const char	*data;	/* NULL if decoding fails */
+	const char	*rest;	/* left on the connection */
+} testcases[] = {
+	{ "5\r\nhello\r\n0\r\n\r\n", "hello", "" },
+	{ "5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n", "hello world", "" },
+	{ "A\r\n0123456789\r\n0\r\n\r\n", "0123456789", "" },
+	{ "00a\r\n0123456789\r\n0\r\n\r\n", "0123456789", "" },
+	{ "5;name=value\r\nhello\r\n0;x\r\n\r\n", "hello", "" },
+	{ "5\nhello\n0\n\n", "hello", "" },
+	{ "0\r\n\r\n", "", "" },
+	{ "3\r\nabc\r\n0\r\nExpires: never\r\nX: y\r\n\r\n", "abc", "" },
+	{ "3\r\nabc\r\n0\r\n\r\nHTTP/1.1 200 OK\r\n", "abc",
+	    "HTTP/1.1 200 OK\r\n" },
+	{ "3\r\nabc\r\n0\r\n", "abc", "" },
+	{ "3\r\nabc\r\n0\r\nX: y\r\n", "abc", "" },
+	{ "", NULL },
+	{ "3\r\nab", NULL },
+	{ "3\r\nabc\r\n", NULL },
+	{ "\r\nabc\r\n0\r\n\r\n", NULL },
+	{ "x\r\nabc\r\n0\r\n\r\n", NULL },
+	{ "3\r\nabcd\r\n0\r\n\r\n", NULL },
+	{ "3\r\nabc\rx0\r\n\r\n", NULL },
+	{ "3\r\nabc\r\n0\r\n\rx", NULL },
+	{ "10000000000000000\r\n", NULL },
+};
+
+/*
+ * Decode body in a process of its own, failures end it with errx().
+ * Exits 0 if the output and what is left of the input are as expected.
+ */
+static void
+decode(size_t tc, size_t bufsize)
+{
+	struct url	 url;
+	FILE		*dst_fp;
+	char		*buf, out[BUFSIZ];
+	size_t		 len, n;
+	off_t		 offset = 0;
+	int		 fds[2];
+
+	if (testcases[tc].data == NULL && freopen("/dev/null", "w",
+	    stderr) == NULL)
+		err(1, "freopen");
+
+	/* the bodies are short enough to go into the pipe upfront */
+	if (pipe(fds) == -1)
+		err(1, "pipe");
+
+	len = strlen(testcases[tc].body);
+	if (write(fds[1], testcases[tc].body, len) != (ssize_t)len)
+		err(1, "write");
+
+	close(fds[1]);
+	if ((dst_fp = tmpfile()) == NULL)
+		err(1, "tmpfile");
+
+	memset(&url, 0, sizeof url);
+	io = iobuf_new(fds[0]);
+	io->size = bufsize;
+	http_save_chunks(&url, dst_fp, &offset);
+
+	rewind(dst_fp);
+	n = fread(out, 1, sizeof(out) - 1, dst_fp);
+	out[n] = '\0';
+	if (strcmp(out, testcases[tc].data) != 0 ||
+	    offset != (off_t)strlen(testcases[tc].data))
+		exit(2);
+
+	n = 0;
+	while ((buf = iobuf_peek(io, &len)) != NULL && len > 0) {
+		if (n + len >= sizeof(out))
+			exit(2);
+
+		memcpy(out + n, buf, len);
+		n += len;
+		iobuf_consume(io, len);
+	}
+	out[n] = '\0';
+	if (strcmp(out, testcases[tc].rest) != 0)
+		exit(2);
+
+	exit(0);
+}
+
+int
+main(void)
+{
+	size_t	i, j;
+	pid_t	pid;
+	int	status;
+
+	for (i = 0; i < nitems(testcases); i++) {
+		for (j = 0; j < nitems(bufsizes); j++) {
+			switch (pid = fork()) {
+			case -1:
+				err(1, "fork");
+			case 0:
+				decode(i, bufsizes[j]);
+				/* NOTREACHED */
+			}
+
+			if (waitpid(pid, &status, 0) == -1)
+				err(1, "waitpid");
+
+			/* errx() exits 1, a wrong result 2 */
+			if (!WIFEXITED(status) ||
+			    WEXITSTATUS(status) != (testcases[i].data ? 0 : 1))
+				goto bad;
+		}
+	}
+
+	return 0;
+
+ bad:
+	fprintf(stderr, "%zu: %s (%zu byte reads)\n", i, testcases[i].body,
+	    bufsizes[j]);
+	return 1;
+}
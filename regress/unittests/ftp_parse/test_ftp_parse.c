@@ -0,0 +1,105 @@
+/*
+ * Placed in the public domain.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include <imsg.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ftp.h"
+
+#ifndef nitems
+#define nitems(_a)	(sizeof((_a)) / sizeof((_a)[0]))
+#endif
+
+/* 2020-01-02 03:04:05 UTC */
+#define MTIME	1577934245
+
+struct imsgbuf		 child_ibuf;
+const char		*useragent = "OpenBSD ftp";
+int			 activemode, compressed, family = AF_UNSPEC, io_debug;
+int			 connect_delay, dns_ttl, modez, progressmeter;
+int			 segments = 1, verbose;
+volatile sig_atomic_t	 interrupted;
+
+static struct {
+	int		 mlsd;
+	const char	*line;
+	int		 ret;
+	struct ftp_entry ent;
+} testcases[] = {
+	{ 1, "type=file;size=1234;modify=20200102030405; f.txt",
+	    0, { "f.txt", 1234, MTIME, FT_FILE } },
+	{ 1, "Type=dir;Modify=20200102030405.123;UNIX.mode=0755; sub dir",
+	    0, { "sub dir", -1, MTIME, FT_DIR } },
+	{ 1, "type=cdir;modify=20200102030405; .",
+	    0, { ".", -1, MTIME, FT_OTHER } },
+	{ 1, "type=OS.unix=slink:/etc;size=4; link",
+	    0, { "link", 4, -1, FT_OTHER } },
+	{ 1, "type=file;modify=2020; short-time",
+	    0, { "short-time", -1, -1, FT_FILE } },
+	{ 1, "type=file;modify=20200102030405Z; bad-time",
+	    0, { "bad-time", -1, -1, FT_FILE } },
+	{ 1, "size=1;unique=x;type=file; a ; b",
+	    0, { "a ; b", 1, -1, FT_FILE } },
+	{ 1, "type=file;size=12x; bad-size", -1 },
+	{ 1, "type=file;size=-1; negative", -1 },
+	{ 1, "type=file;size=1;", -1 },
+	{ 0, "-rw-r--r--   1 ftp  ftp      1234 Jan  2 03:04 f.txt",
+	    0, { "f.txt", 1234, -1, FT_FILE } },
+	{ 0, "drwxr-xr-x 2 ftp ftp 4096 Jan  2  2020 sub dir",
+	    0, { "sub dir", 4096, -1, FT_DIR } },
+	{ 0, "lrwxrwxrwx 1 ftp ftp 4 Jan 2 03:04 link -> /etc",
+	    0, { "link -> /etc", 4, -1, FT_OTHER } },
+	{ 0, "-rw-r--r--\t1\tftp\tftp\t5\tJan\t2\t03:04\ttabs",
+	    0, { "tabs", 5, -1, FT_FILE } },
+	{ 0, "total 12", -1 },
+	{ 0, "-rw-r--r-- 1 ftp ftp 1k Jan 2 03:04 bad-size", -1 },
+	{ 0, "-rw-r--r-- 1 ftp ftp 5 Jan 2 03:04 ", -1 },
+	{ 0, "", -1 },
+};
+
+static int
+ent_cmp(struct ftp_entry *a, struct ftp_entry *b)
+{
+	return strcmp(a->name, b->name) != 0 || a->size != b->size ||
+	    a->mtime != b->mtime || a->type != b->type;
+}
+
+int
+main(void)
+{
+	struct ftp_entry	 ent;
+	char			*line;
+	size_t			 i;
+	int			 ret;
+
+	for (i = 0; i < nitems(testcases); i++) {
+		/* the parsers cut the line up in place */
+		if ((line = strdup(testcases[i].line)) == NULL)
+			return 1;
+
+		if (testcases[i].mlsd)
+			ret = ftp_parse_mlsd(line, &ent);
+		else
+			ret = ftp_parse_list(line, &ent);
+
+		if (ret != testcases[i].ret ||
+		    (ret == 0 && ent_cmp(&ent, &testcases[i].ent) != 0))
+			goto bad;
+
+		free(line);
+	}
+
+	return 0;
+
+ bad:
+	fprintf(stderr, "%s\n", testcases[i].line);
+	return 1;
+}
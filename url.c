@@ -222,6 +222,8 @@ url_free(struct url *url)
 	free(url->path);
 	freezero(url->basic_auth, BASICAUTH_LEN);
 	free(url->fname);
+	free(url->etag);
+	free(url->last_modified);
 	free(url);
 }
 
@@ -240,14 +242,15 @@ url_connect(struct url *url, struct url *proxy, int timeout)
 }
 
 struct url *
-url_request(struct url *url, struct url *proxy, off_t *offset, off_t *sz)
+url_request(struct url *url, struct url *proxy, int timeout, off_t *offset,
+    off_t *sz)
 {
 	switch (url->scheme) {
 	case S_HTTP:
 	case S_HTTPS:
-		return http_get(url, proxy, offset, sz);
+		return http_get(url, proxy, timeout, offset, sz);
 	case S_FTP:
-		return ftp_get(url, proxy, offset, sz);
+		return ftp_get(url, proxy, timeout, offset, sz);
 	case S_FILE:
 		return file_request(&child_ibuf, url, offset, sz);
 	}
@@ -272,6 +275,40 @@ url_save(struct url *url, FILE *dst_fp, off_t *offset)
 	}
 }
 
+void
+url_save_range(struct url *url, struct url *proxy, int timeout, off_t start,
+    off_t len, FILE *dst_fp, off_t *offset)
+{
+	switch (url->scheme) {
+	case S_HTTP:
+	case S_HTTPS:
+		http_save_range(url, proxy, timeout, start, len, dst_fp,
+		    offset);
+		break;
+	case S_FTP:
+		ftp_save_range(url, timeout, start, len, dst_fp, offset);
+		break;
+	default:
+		errx(1, "%s: ranges not supported", __func__);
+	}
+}
+
+/*
+ * Send the request for url ahead of time on the current connection if
+ * the protocol allows it, returns 1 if it was sent.
+ */
+int
+url_pipeline(struct url *url, struct url *proxy)
+{
+	switch (url->scheme) {
+	case S_HTTP:
+	case S_HTTPS:
+		return http_pipeline(url, proxy);
+	default:
+		return 0;
+	}
+}
+
 void
 url_close(struct url *url)
 {
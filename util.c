@@ -15,11 +15,15 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/queue.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 
+#include <asr.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <imsg.h>
 #include <netdb.h>
 #include <poll.h>
@@ -28,12 +32,44 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
+#ifndef NOSSL
+#include <tls.h>
+#endif
 
 #include "ftp.h"
 #include "xmalloc.h"
 
-static void	tooslow(int);
+#define MAP_WINDOW	(8 * 1024 * 1024)
+
+/*
+ * Resolver answer cached for dns_ttl seconds, a negative one only if the
+ * name doesn't exist. Transient failures are kept for no time at all.
+ */
+struct dns_entry {
+	TAILQ_ENTRY(dns_entry)	 entry;
+	struct asr_query	*aq;
+	struct addrinfo		*res;
+	char			*host;
+	char			*port;
+	time_t			 expire;
+	int			 error;
+	int			 family;
+};
+
+static time_t		 dns_expire(int);
+static struct dns_entry	*dns_find(const char *, const char *);
+static void		 dns_free(struct dns_entry *);
+static int		 dns_lookup(const char *, const char *,
+			    struct addrinfo **);
+static struct dns_entry	*dns_new(const char *, const char *);
+static void		 dns_step(struct dns_entry *, struct pollfd *,
+			    long long *);
+static long long	 monotime_ms(void);
+
+static TAILQ_HEAD(, dns_entry)	dns_cache = TAILQ_HEAD_INITIALIZER(dns_cache);
 
 /*
  * Wait for an asynchronous connect(2) attempt to finish.
@@ -59,81 +95,392 @@ connect_wait(int s)
 	return 0;
 }
 
-static void
-tooslow(int signo)
+static long long
+monotime_ms(void)
 {
-	dprintf(STDERR_FILENO, "%s: connect taking too long\n", getprogname());
-	_exit(2);
+	struct timespec	ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		err(1, "clock_gettime");
+
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Order addresses so that families alternate, starting with the family
+ * of the first (preferred) address, RFC 8305 section 4.
+ */
+static struct addrinfo **
+addrinfo_interleave(struct addrinfo *res0, size_t *naddrs)
+{
+	struct addrinfo	**addrs, *res, *first, *second;
+	size_t		  n;
+
+	for (n = 0, res = res0; res; res = res->ai_next)
+		n++;
+
+	addrs = xcalloc(n, sizeof(*addrs));
+	first = res0;
+	second = res0;
+	for (*naddrs = 0; *naddrs < n;) {
+		while (first && first->ai_family != res0->ai_family)
+			first = first->ai_next;
+		if (first) {
+			addrs[(*naddrs)++] = first;
+			first = first->ai_next;
+		}
+
+		while (second && second->ai_family == res0->ai_family)
+			second = second->ai_next;
+		if (second) {
+			addrs[(*naddrs)++] = second;
+			second = second->ai_next;
+		}
+	}
+
+	return addrs;
 }
 
+/*
+ * Connect to host, racing the addresses it resolves to (Happy Eyeballs,
+ * RFC 8305): a new non-blocking attempt is started every connect_delay
+ * milliseconds, or as soon as the previous one failed, while earlier
+ * attempts stay in flight. The first one to complete wins. A non-zero
+ * timeout bounds the whole race, in seconds.
+ */
 int
 tcp_connect(const char *host, const char *port, int timeout)
 {
-	struct addrinfo	 hints, *res, *res0;
+	struct addrinfo	*res, *res0, **addrs;
+	struct pollfd	*pfds;
 	char		 hbuf[NI_MAXHOST];
 	const char	*cause = NULL;
-	int		 error, s = -1, save_errno;
+	long long	 deadline, last, now, wait;
+	socklen_t	 len;
+	size_t		 i, naddrs, next, pending;
+	int		 error, flags, s = -1, save_errno = 0;
 
 	if (host == NULL) {
 		warnx("hostname missing");
 		return -1;
 	}
 
-	memset(&hints, 0, sizeof hints);
-	hints.ai_family = family;
-	hints.ai_socktype = SOCK_STREAM;
-	if ((error = getaddrinfo(host, port, &hints, &res0))) {
+	if ((error = dns_lookup(host, port, &res0))) {
 		warnx("%s: %s", host, gai_strerror(error));
 		return -1;
 	}
 
-	if (timeout) {
-		(void)signal(SIGALRM, tooslow);
-		alarm(timeout);
-	}
+	timing_mark(TIMING_DNS);
 
-	for (res = res0; res; res = res->ai_next) {
-		if (getnameinfo(res->ai_addr, res->ai_addrlen, hbuf,
-		    sizeof hbuf, NULL, 0, NI_NUMERICHOST) != 0)
-			(void)strlcpy(hbuf, "(unknown)", sizeof hbuf);
+	addrs = addrinfo_interleave(res0, &naddrs);
+	pfds = xcalloc(naddrs, sizeof(*pfds));
+	for (i = 0; i < naddrs; i++)
+		pfds[i].fd = -1;
 
-		log_info("Trying %s...\n", hbuf);
-		s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-		if (s == -1) {
-			cause = "socket";
+	last = now = monotime_ms();
+	deadline = timeout ? now + timeout * 1000LL : 0;
+	next = pending = 0;
+	while (s == -1 && !interrupted) {
+		if (next < naddrs &&
+		    (pending == 0 || now - last >= connect_delay)) {
+			res = addrs[next];
+			if (getnameinfo(res->ai_addr, res->ai_addrlen, hbuf,
+			    sizeof hbuf, NULL, 0, NI_NUMERICHOST) != 0)
+				(void)strlcpy(hbuf, "(unknown)", sizeof hbuf);
+
+			log_info("Trying %s...\n", hbuf);
+			last = now;
+			pfds[next].fd = socket(res->ai_family,
+			    res->ai_socktype | SOCK_NONBLOCK, res->ai_protocol);
+			if (pfds[next].fd == -1) {
+				cause = "socket";
+				save_errno = errno;
+			} else if (connect(pfds[next].fd, res->ai_addr,
+			    res->ai_addrlen) == 0) {
+				s = pfds[next].fd;
+				pfds[next].fd = -1;
+				break;
+			} else if (errno == EINPROGRESS) {
+				pfds[next].events = POLLOUT;
+				pending++;
+			} else {
+				cause = "connect";
+				save_errno = errno;
+				close(pfds[next].fd);
+				pfds[next].fd = -1;
+			}
+			next++;
 			continue;
 		}
 
-		for (error = connect(s, res->ai_addr, res->ai_addrlen);
-		    error != 0 && errno == EINTR; error = connect_wait(s))
-			continue;
+		/* every address was tried and failed */
+		if (pending == 0)
+			break;
 
-		if (error != 0) {
-			cause = "connect";
-			save_errno = errno;
-			close(s);
-			errno = save_errno;
-			s = -1;
-			continue;
+		wait = -1;
+		if (next < naddrs)
+			wait = last + connect_delay - now;
+		if (deadline) {
+			if (deadline <= now) {
+				cause = NULL;
+				break;
+			}
+			if (wait == -1 || deadline - now < wait)
+				wait = deadline - now;
 		}
 
-		break;
+		if (poll(pfds, next, wait) == -1 && errno != EINTR)
+			err(1, "%s: poll", __func__);
+
+		for (i = 0; i < next; i++) {
+			if (pfds[i].fd == -1 || pfds[i].revents == 0)
+				continue;
+
+			len = sizeof(error);
+			if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR,
+			    &error, &len) == -1)
+				error = errno;
+
+			if (error == 0) {
+				s = pfds[i].fd;
+				pfds[i].fd = -1;
+				break;
+			}
+
+			cause = "connect";
+			save_errno = error;
+			close(pfds[i].fd);
+			pfds[i].fd = -1;
+			pending--;
+		}
+		now = monotime_ms();
 	}
 
-	freeaddrinfo(res0);
+	/* losers of the race */
+	for (i = 0; i < naddrs; i++)
+		if (pfds[i].fd != -1)
+			close(pfds[i].fd);
+
+	free(pfds);
+	free(addrs);
 	if (s == -1) {
-		warn("%s", cause);
+		if (interrupted)
+			warnx("%s: connect interrupted", host);
+		else if (cause == NULL)
+			warnx("%s: connect taking too long", host);
+		else {
+			errno = save_errno;
+			warn("%s", cause);
+		}
 		return -1;
 	}
 
-	if (timeout) {
-		signal(SIGALRM, SIG_DFL);
-		alarm(0);
-	}
+	if ((flags = fcntl(s, F_GETFL)) == -1 ||
+	    fcntl(s, F_SETFL, flags & ~O_NONBLOCK) == -1)
+		err(1, "%s: fcntl", __func__);
 
+	timing_mark(TIMING_CONNECT);
 	return s;
 }
 
+/*
+ * Resolve host and port, answering from the cache while the entry is
+ * fresh. The returned addrinfo belongs to the cache and stays valid
+ * until the next lookup.
+ */
+static int
+dns_lookup(const char *host, const char *port, struct addrinfo **res)
+{
+	struct addrinfo		 hints;
+	struct dns_entry	*e;
+
+	if ((e = dns_find(host, port)) == NULL) {
+		e = dns_new(host, port);
+		memset(&hints, 0, sizeof hints);
+		hints.ai_family = family;
+		hints.ai_socktype = SOCK_STREAM;
+		e->error = getaddrinfo(host, port, &hints, &e->res);
+		e->expire = dns_expire(e->error);
+	}
+
+	*res = e->res;
+	return e->error;
+}
+
+/*
+ * Queue an asynchronous lookup for a host that will be connected to
+ * later, dns_prefetch_run() resolves all queued lookups at once.
+ */
+void
+dns_prefetch(const char *host, const char *port)
+{
+	struct addrinfo		 hints;
+	struct dns_entry	*e;
+
+	if (dns_ttl == 0 || host == NULL || dns_find(host, port) != NULL)
+		return;
+
+	e = dns_new(host, port);
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = family;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((e->aq = getaddrinfo_async(host, port, &hints, NULL)) == NULL) {
+		TAILQ_REMOVE(&dns_cache, e, entry);
+		dns_free(e);
+	}
+}
+
+void
+dns_prefetch_run(void)
+{
+	struct dns_entry	 *e, **ents;
+	struct pollfd		 *pfds;
+	long long		 *deadlines, now, wait;
+	size_t			  i, n, pending;
+
+	n = 0;
+	TAILQ_FOREACH(e, &dns_cache, entry)
+		if (e->aq != NULL)
+			n++;
+
+	if (n == 0)
+		return;
+
+	ents = xcalloc(n, sizeof(*ents));
+	pfds = xcalloc(n, sizeof(*pfds));
+	deadlines = xcalloc(n, sizeof(*deadlines));
+	i = 0;
+	TAILQ_FOREACH(e, &dns_cache, entry)
+		if (e->aq != NULL)
+			ents[i++] = e;
+
+	for (i = 0; i < n; i++)
+		dns_step(ents[i], &pfds[i], &deadlines[i]);
+
+	for (;;) {
+		now = monotime_ms();
+		wait = -1;
+		for (pending = 0, i = 0; i < n; i++) {
+			if (pfds[i].fd == -1)
+				continue;
+
+			pending++;
+			if (wait == -1 || deadlines[i] - now < wait)
+				wait = deadlines[i] > now ? deadlines[i] - now : 0;
+		}
+
+		if (pending == 0)
+			break;
+
+		if (poll(pfds, n, wait) == -1 && errno != EINTR)
+			err(1, "%s: poll", __func__);
+
+		now = monotime_ms();
+		for (i = 0; i < n; i++)
+			if (pfds[i].fd != -1 &&
+			    (pfds[i].revents != 0 || deadlines[i] <= now))
+				dns_step(ents[i], &pfds[i], &deadlines[i]);
+	}
+
+	free(deadlines);
+	free(pfds);
+	free(ents);
+}
+
+/*
+ * Advance an asynchronous lookup, on completion its answer is cached
+ * and pfd is disabled.
+ */
+static void
+dns_step(struct dns_entry *e, struct pollfd *pfd, long long *deadline)
+{
+	struct asr_result	ar;
+
+	if (asr_run(e->aq, &ar) == 0) {
+		pfd->fd = ar.ar_fd;
+		pfd->events = ar.ar_cond == ASR_WANT_READ ? POLLIN : POLLOUT;
+		*deadline = monotime_ms() + ar.ar_timeout;
+		return;
+	}
+
+	e->aq = NULL;
+	e->res = ar.ar_addrinfo;
+	e->error = ar.ar_gai_errno;
+	e->expire = dns_expire(e->error);
+	pfd->fd = -1;
+}
+
+/*
+ * When an answer with the getaddrinfo error code error is due to go, a
+ * timed out or failing server mustn't fail later lookups of the name.
+ */
+static time_t
+dns_expire(int error)
+{
+	switch (error) {
+	case 0:
+	case EAI_NONAME:
+#ifdef EAI_NODATA
+	case EAI_NODATA:
+#endif
+		return monotime() + dns_ttl;
+	default:
+		return monotime();
+	}
+}
+
+/*
+ * Look up a cached entry, pruning expired ones along the way.
+ */
+static struct dns_entry *
+dns_find(const char *host, const char *port)
+{
+	struct dns_entry	*e, *next;
+	time_t			 now;
+
+	now = monotime();
+	for (e = TAILQ_FIRST(&dns_cache); e != NULL; e = next) {
+		next = TAILQ_NEXT(e, entry);
+		if (e->aq == NULL && e->expire <= now) {
+			TAILQ_REMOVE(&dns_cache, e, entry);
+			dns_free(e);
+			continue;
+		}
+
+		if (e->family == family && strcmp(e->host, host) == 0 &&
+		    strcmp(e->port, port) == 0)
+			return e;
+	}
+
+	return NULL;
+}
+
+static struct dns_entry *
+dns_new(const char *host, const char *port)
+{
+	struct dns_entry	*e;
+
+	e = xcalloc(1, sizeof *e);
+	e->host = xstrdup(host);
+	e->port = xstrdup(port);
+	e->family = family;
+	TAILQ_INSERT_TAIL(&dns_cache, e, entry);
+	return e;
+}
+
+static void
+dns_free(struct dns_entry *e)
+{
+	if (e->aq != NULL)
+		asr_abort(e->aq);
+	if (e->res != NULL)
+		freeaddrinfo(e->res);
+
+	free(e->host);
+	free(e->port);
+	free(e);
+}
+
 int
 fd_request(char *path, int flags, off_t *offset)
 {
@@ -202,15 +549,194 @@ log_info(const char *fmt, ...)
 	va_end(ap);
 }
 
+/*
+ * Move len bytes from src to the regular file dst by reading them
+ * straight into a shared mapping of dst, which saves the write(2) copy.
+ * The file is grown to its final size first and cut back to the bytes
+ * received if src ends early, fails or the transfer is interrupted.
+ * Returns the number of bytes moved, or -1 if mapping isn't possible
+ * and nothing was moved, in which case the caller falls back to copying.
+ */
+off_t
+fd_splice(int dst, int src, off_t len, off_t *offset)
+{
+	struct stat	 sb;
+	const char	*failed = NULL;
+	off_t		 end, pos, total = 0, wstart;
+	ssize_t		 r;
+	size_t		 wlen;
+	char		*map;
+	int		 flags, grown = 0, saved_errno = 0;
+
+	/* the mapping has to cover the whole body, so its size is needed */
+	if (len <= 0 || fstat(dst, &sb) == -1 || !S_ISREG(sb.st_mode))
+		return -1;
+
+	if ((flags = fcntl(dst, F_GETFL)) == -1 || flags & O_APPEND)
+		return -1;
+
+	if ((pos = lseek(dst, 0, SEEK_CUR)) == -1)
+		return -1;
+
+	end = pos + len;
+	if (sb.st_size < end) {
+		if (ftruncate(dst, end) == -1)
+			return -1;
+		grown = 1;
+	}
+
+	while (pos < end && !interrupted && failed == NULL) {
+		wstart = pos - pos % getpagesize();
+		wlen = MAP_WINDOW;
+		if (end - wstart < MAP_WINDOW)
+			wlen = end - wstart;
+
+		map = mmap(NULL, wlen, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    dst, wstart);
+		if (map == MAP_FAILED && total == 0) {
+			total = -1;
+			break;
+		}
+
+		if (map == MAP_FAILED) {
+			saved_errno = errno;
+			failed = "mmap";
+			break;
+		}
+
+		/* read(2) fills the file pages, no write(2) copy after it */
+		r = -1;
+		while (pos < wstart + (off_t)wlen && !interrupted && r != 0) {
+			r = read(src, map + (pos - wstart),
+			    wstart + wlen - pos);
+			if (r == -1 && errno == EINTR)
+				continue;
+
+			if (r == -1) {
+				saved_errno = errno;
+				failed = "read";
+				break;
+			}
+
+			pos += r;
+			total += r;
+			*offset += r;
+		}
+
+		munmap(map, wlen);
+		if (r == 0)
+			break;
+	}
+
+	/* never leave a zero filled tail behind for -C to trust */
+	if (grown && pos < end && ftruncate(dst, pos) == -1)
+		err(1, "%s: ftruncate", __func__);
+
+	if (lseek(dst, pos, SEEK_SET) == -1)
+		err(1, "%s: lseek", __func__);
+
+	if (failed != NULL) {
+		errno = saved_errno;
+		err(1, "%s: %s", __func__, failed);
+	}
+
+	return total;
+}
+
+/*
+ * Send up to len bytes, all of them if len is -1, of the regular file
+ * src from its current offset to dst. src is mapped and written from
+ * the mapping, which saves the read(2) copy, in slices so that progress
+ * and interruption are seen. The offset of src is left past the bytes
+ * sent. Returns the number of bytes sent, or -1 if mapping isn't
+ * possible and nothing was sent, in which case the caller falls back.
+ */
+off_t
+fd_sendfile(int dst, int src, off_t len, off_t *offset)
+{
+	struct stat	 sb;
+	off_t		 end, pos, total = 0, wstart;
+	ssize_t		 w;
+	size_t		 n, wlen;
+	char		*map;
+
+	if (fstat(src, &sb) == -1 || !S_ISREG(sb.st_mode) ||
+	    (pos = lseek(src, 0, SEEK_CUR)) == -1)
+		return -1;
+
+	end = sb.st_size;
+	if (len >= 0 && pos + len < end)
+		end = pos + len;
+
+	while (pos < end && !interrupted) {
+		wstart = pos - pos % getpagesize();
+		wlen = MAP_WINDOW;
+		if (end - wstart < MAP_WINDOW)
+			wlen = end - wstart;
+
+		map = mmap(NULL, wlen, PROT_READ, MAP_SHARED, src, wstart);
+		if (map == MAP_FAILED && total == 0)
+			return -1;
+
+		if (map == MAP_FAILED)
+			err(1, "%s: mmap", __func__);
+
+		/* written from the page cache, no read(2) copy before it */
+		while (pos < wstart + (off_t)wlen && !interrupted) {
+			n = TMPBUF_LEN;
+			if (wstart + (off_t)wlen - pos < TMPBUF_LEN)
+				n = wstart + wlen - pos;
+
+			w = write(dst, map + (pos - wstart), n);
+			if (w == -1 && errno == EINTR)
+				continue;
+
+			if (w == -1)
+				err(1, "%s: write", __func__);
+
+			pos += w;
+			total += w;
+			*offset += w;
+		}
+
+		munmap(map, wlen);
+	}
+
+	if (lseek(src, pos, SEEK_SET) == -1)
+		err(1, "%s: lseek", __func__);
+
+	return total;
+}
+
+/*
+ * Copy up to len bytes, all of src if len is -1.
+ */
 void
-copy_file(FILE *dst, FILE *src, off_t *offset)
+copy_file(FILE *dst, FILE *src, off_t len, off_t *offset)
 {
 	char	*tmp_buf;
-	size_t	 r;
+	size_t	 n, r;
+
+	/* nothing has been read from src yet, its stdio buffer is empty */
+	if (fflush(dst) == EOF)
+		err(1, "%s: fflush", __func__);
+
+	if (fd_sendfile(fileno(dst), fileno(src), len, offset) != -1 ||
+	    fd_splice(fileno(dst), fileno(src), len, offset) != -1)
+		return;
 
 	tmp_buf = xmalloc(TMPBUF_LEN);
-	while ((r = fread(tmp_buf, 1, TMPBUF_LEN, src)) != 0 && !interrupted) {
+	while (len != 0 && !interrupted) {
+		n = TMPBUF_LEN;
+		if (len > 0 && len < TMPBUF_LEN)
+			n = len;
+
+		if ((r = fread(tmp_buf, 1, n, src)) == 0)
+			break;
+
 		*offset += r;
+		if (len > 0)
+			len -= r;
 		if (fwrite(tmp_buf, 1, r, dst) != r)
 			err(1, "%s: fwrite", __func__);
 	}
@@ -220,8 +746,280 @@ copy_file(FILE *dst, FILE *src, off_t *offset)
 		return;
 	}
 
-	if (!feof(src))
+	if (len != 0 && !feof(src))
 		errx(1, "%s: fread", __func__);
 
 	free(tmp_buf);
 }
+
+/*
+ * Decompress the zlib stream read from src into dst, as received in
+ * FTP MODE Z. offset counts the bytes written.
+ */
+void
+inflate_file(FILE *dst, FILE *src, off_t *offset)
+{
+	z_stream	 zs;
+	char		*in, *out;
+	size_t		 n, r;
+	int		 ret = Z_OK;
+
+	memset(&zs, 0, sizeof zs);
+	if (inflateInit(&zs) != Z_OK)
+		errx(1, "%s: inflateInit", __func__);
+
+	in = xmalloc(TMPBUF_LEN);
+	out = xmalloc(TMPBUF_LEN);
+	while (ret != Z_STREAM_END && !interrupted &&
+	    (r = fread(in, 1, TMPBUF_LEN, src)) != 0) {
+		zs.next_in = (Bytef *)in;
+		zs.avail_in = r;
+		do {
+			zs.next_out = (Bytef *)out;
+			zs.avail_out = TMPBUF_LEN;
+			ret = inflate(&zs, Z_NO_FLUSH);
+			if (ret != Z_OK && ret != Z_STREAM_END)
+				errx(1, "%s: %s", __func__,
+				    zs.msg ? zs.msg : "inflate failed");
+
+			n = TMPBUF_LEN - zs.avail_out;
+			if (fwrite(out, 1, n, dst) != n)
+				err(1, "%s: fwrite", __func__);
+
+			*offset += n;
+		} while (zs.avail_out == 0 && ret != Z_STREAM_END);
+	}
+
+	inflateEnd(&zs);
+	free(in);
+	free(out);
+	if (ferror(src))
+		errx(1, "%s: fread", __func__);
+
+	if (ret != Z_STREAM_END && !interrupted)
+		errx(1, "%s: compressed data truncated", __func__);
+}
+
+/*
+ * Compress src into a zlib stream written to dst, for FTP MODE Z.
+ * offset counts the bytes read.
+ */
+void
+deflate_file(FILE *dst, FILE *src, off_t *offset)
+{
+	z_stream	 zs;
+	char		*in, *out;
+	size_t		 n, r;
+	int		 flush;
+
+	memset(&zs, 0, sizeof zs);
+	if (deflateInit(&zs, Z_DEFAULT_COMPRESSION) != Z_OK)
+		errx(1, "%s: deflateInit", __func__);
+
+	in = xmalloc(TMPBUF_LEN);
+	out = xmalloc(TMPBUF_LEN);
+	do {
+		r = fread(in, 1, TMPBUF_LEN, src);
+		if (ferror(src))
+			errx(1, "%s: fread", __func__);
+
+		*offset += r;
+		flush = feof(src) ? Z_FINISH : Z_NO_FLUSH;
+		zs.next_in = (Bytef *)in;
+		zs.avail_in = r;
+		do {
+			zs.next_out = (Bytef *)out;
+			zs.avail_out = TMPBUF_LEN;
+			if (deflate(&zs, flush) == Z_STREAM_ERROR)
+				errx(1, "%s: deflate failed", __func__);
+
+			n = TMPBUF_LEN - zs.avail_out;
+			if (fwrite(out, 1, n, dst) != n)
+				err(1, "%s: fwrite", __func__);
+		} while (zs.avail_out == 0);
+	} while (flush != Z_FINISH && !interrupted);
+
+	deflateEnd(&zs);
+	free(in);
+	free(out);
+}
+
+/*
+ * Buffered reader shared by the HTTP, HTTPS and FTP control connections.
+ * Data is read in bulk into a buffer, lines are found with memchr(3) and
+ * callers may peek at the buffered bytes and consume them in place.
+ */
+struct iobuf *
+iobuf_new(int fd)
+{
+	struct iobuf	*io;
+
+	io = xcalloc(1, sizeof *io);
+	io->buf = xmalloc(TMPBUF_LEN);
+	io->size = TMPBUF_LEN;
+	io->fd = fd;
+	return io;
+}
+
+/*
+ * Release the buffer and close the descriptor, any TLS context has to
+ * be closed by the caller beforehand.
+ */
+void
+iobuf_free(struct iobuf *io)
+{
+	if (io == NULL)
+		return;
+
+	close(io->fd);
+	free(io->buf);
+	free(io);
+}
+
+static ssize_t
+iobuf_recv(struct iobuf *io, char *buf, size_t len)
+{
+	ssize_t	r;
+
+#ifndef NOSSL
+	if (io->tls) {
+		do {
+			r = tls_read(io->tls, buf, len);
+		} while (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT);
+		if (r == -1)
+			errx(1, "tls_read: %s", tls_error(io->tls));
+
+		return r;
+	}
+#endif
+	while ((r = read(io->fd, buf, len)) == -1 && errno == EINTR)
+		continue;
+
+	if (r == -1)
+		err(1, "read");
+
+	return r;
+}
+
+/*
+ * Append data from the connection to the buffer, moving the unread
+ * bytes to the front first if there is no room left behind them.
+ * Returns the number of bytes read, 0 on EOF.
+ */
+ssize_t
+iobuf_fill(struct iobuf *io)
+{
+	ssize_t	r;
+
+	if (io->len == 0)
+		io->off = 0;
+	else if (io->off + io->len == io->size) {
+		memmove(io->buf, io->buf + io->off, io->len);
+		io->off = 0;
+	}
+
+	if (io->off + io->len == io->size)
+		errx(1, "%s: buffer full", __func__);
+
+	r = iobuf_recv(io, io->buf + io->off + io->len,
+	    io->size - io->off - io->len);
+	io->len += r;
+	return r;
+}
+
+/*
+ * Return the buffered bytes, reading more if there are none. *len is
+ * set to 0 on EOF.
+ */
+char *
+iobuf_peek(struct iobuf *io, size_t *len)
+{
+	if (io->len == 0)
+		(void)iobuf_fill(io);
+
+	*len = io->len;
+	return io->buf + io->off;
+}
+
+void
+iobuf_consume(struct iobuf *io, size_t len)
+{
+	if (len > io->len)
+		errx(1, "%s: %zu bytes buffered, %zu consumed", __func__,
+		    io->len, len);
+
+	io->off += len;
+	io->len -= len;
+}
+
+/*
+ * Read a line, newline included, into *lineptr like getline(3).
+ * Returns the line length or -1 if EOF comes first.
+ */
+ssize_t
+iobuf_getline(struct iobuf *io, char **lineptr, size_t *n)
+{
+	char	*nl;
+	size_t	 avail, len, linelen = 0;
+
+	for (;;) {
+		if (io->len == 0 && iobuf_fill(io) == 0)
+			break;
+
+		avail = io->len;
+		if ((nl = memchr(io->buf + io->off, '\n', avail)) != NULL)
+			avail = nl - (io->buf + io->off) + 1;
+
+		len = linelen + avail + 1;
+		if (*lineptr == NULL || *n < len) {
+			*lineptr = xrealloc(*lineptr, len);
+			*n = len;
+		}
+
+		memcpy(*lineptr + linelen, io->buf + io->off, avail);
+		linelen += avail;
+		iobuf_consume(io, avail);
+		if (nl != NULL)
+			break;
+	}
+
+	if (linelen == 0)
+		return -1;
+
+	(*lineptr)[linelen] = '\0';
+	return linelen;
+}
+
+/*
+ * Write all of buf, returns -1 on failure.
+ */
+int
+iobuf_write(struct iobuf *io, const char *buf, size_t len)
+{
+	ssize_t	w;
+
+	while (len > 0) {
+#ifndef NOSSL
+		if (io->tls) {
+			w = tls_write(io->tls, buf, len);
+			if (w == TLS_WANT_POLLIN || w == TLS_WANT_POLLOUT)
+				continue;
+			if (w == -1) {
+				warnx("tls_write: %s", tls_error(io->tls));
+				return -1;
+			}
+		} else
+#endif
+		if ((w = send(io->fd, buf, len, MSG_NOSIGNAL)) == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("send");
+			return -1;
+		}
+
+		buf += w;
+		len -= w;
+	}
+
+	return 0;
+}